@@ -0,0 +1,148 @@
+"""
+Readers for the binary output of HDP (--output_format bin)
+
+The layout of the files is described in topicmodelling/hdp/output.h. They
+are written in the byte order of the machine that ran HDP.
+"""
+
+from array import array
+import struct
+
+TOPICS_MAGIC = "HDPTOPIC"
+ASSIGNMENTS_MAGIC = "HDPASSGN"
+AVERAGE_MAGIC = "HDPAVERG"
+OUTPUT_VERSION = 1
+
+# magic, version, num_rows, size_vocab, reserved, num_entries
+HEADER_FORMAT = "=8siiiiq"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+
+# magic, version, num_samples, iteration, size_vocab, num_topics, num_docs,
+# num_state_topics, burn_in, num_topic_entries, num_doc_entries
+AVERAGE_HEADER_FORMAT = "=8siiiiiiiiqq"
+AVERAGE_HEADER_SIZE = struct.calcsize(AVERAGE_HEADER_FORMAT)
+
+
+def _read_header(fp, magic, path):
+    """
+    Reads the header and row offsets of a binary output file
+
+    :param fp: file opened in binary mode
+    :param magic: magic string the file should start with
+    :param path: path of the file (for error messages)
+    :return: tuple containing the vocabulary size and the list of row offsets
+    """
+    header = struct.unpack(HEADER_FORMAT, fp.read(HEADER_SIZE))
+    if header[0].decode("ascii") != magic or header[1] != OUTPUT_VERSION:
+        raise ValueError("%s is not an HDP output file" % path)
+    num_rows, size_vocab, num_entries = header[2], header[3], header[5]
+    offsets = struct.unpack("=%dq" % (num_rows + 1),
+                            fp.read(8 * (num_rows + 1)))
+    if offsets[-1] != num_entries:
+        raise ValueError("%s is truncated" % path)
+    return size_vocab, offsets
+
+
+def _read_ints(fp, n):
+    values = array("i")
+    values.fromfile(fp, n)
+    return values
+
+
+def read_topic_counts(topics_path):
+    """
+    Reads a *-topics.bin file
+
+    :param topics_path: path to topic-word counts file
+    :return: list containing, for each topic, a list of (word-ID, count)
+        pairs for the words with non-zero counts
+    """
+    fp = open(topics_path, "rb")
+    _, offsets = _read_header(fp, TOPICS_MAGIC, topics_path)
+    words = _read_ints(fp, offsets[-1])
+    counts = _read_ints(fp, offsets[-1])
+    fp.close()
+    return [list(zip(words[offsets[k]:offsets[k + 1]],
+                     counts[offsets[k]:offsets[k + 1]]))
+            for k in range(len(offsets) - 1)]
+
+
+def read_word_assignments(word_assignments_path):
+    """
+    Reads a *-word-assignments.bin file
+
+    :param word_assignments_path: path to word assignments file
+    :return: tuple (offsets, words, topics, tables), where the tokens of
+        document d are those in [offsets[d], offsets[d + 1]) of the other
+        three arrays
+    """
+    fp = open(word_assignments_path, "rb")
+    _, offsets = _read_header(fp, ASSIGNMENTS_MAGIC, word_assignments_path)
+    words = _read_ints(fp, offsets[-1])
+    topics = _read_ints(fp, offsets[-1])
+    tables = _read_ints(fp, offsets[-1])
+    fp.close()
+    return offsets, words, topics, tables
+
+
+def _read_doubles(fp, n):
+    values = array("d")
+    values.fromfile(fp, n)
+    return values
+
+
+def _read_rows(fp, num_rows, num_entries, path):
+    offsets = struct.unpack("=%dq" % (num_rows + 1),
+                            fp.read(8 * (num_rows + 1)))
+    if offsets[-1] != num_entries:
+        raise ValueError("%s is truncated" % path)
+    keys = _read_ints(fp, offsets[-1])
+    values = _read_doubles(fp, offsets[-1])
+    return [(keys[offsets[j]:offsets[j + 1]], values[offsets[j]:offsets[j + 1]])
+            for j in range(num_rows)]
+
+
+def read_posterior_average(average_path):
+    """
+    Reads the average.bin file of a run with --burn_in
+
+    :param average_path: path to posterior average file
+    :return: tuple (topic_words, doc_topics, num_samples), where
+        topic_words[k] is (num_samples_k, floor, dict mapping word-ID to
+        probability): the average probability of a word in topic k over the
+        num_samples_k samples topic k was in, the floor for the words not in
+        the dict; and doc_topics[d], for the document with ID d, is a dict
+        mapping topic to its average proportion in the document, for all the
+        topics (the rest is the mass of topics not yet seen)
+    """
+    fp = open(average_path, "rb")
+    header = struct.unpack(AVERAGE_HEADER_FORMAT, fp.read(AVERAGE_HEADER_SIZE))
+    if (header[0].decode("ascii") != AVERAGE_MAGIC or
+            header[1] != OUTPUT_VERSION):
+        raise ValueError("%s is not an HDP average file" % average_path)
+    num_samples, num_topics, num_docs = header[2], header[5], header[6]
+    num_topic_entries, num_doc_entries = header[9], header[10]
+    samples = _read_ints(fp, num_topics)
+    weights = _read_doubles(fp, num_topics)
+    floors = _read_doubles(fp, num_topics)
+    topic_rows = _read_rows(fp, num_topics, num_topic_entries, average_path)
+    smoothing = _read_doubles(fp, num_docs)
+    doc_rows = _read_rows(fp, num_docs, num_doc_entries, average_path)
+    fp.close()
+
+    # the file has the sums over the samples
+    n = float(max(num_samples, 1))
+    topic_words = []
+    for k, (words, values) in enumerate(topic_rows):
+        floor = floors[k] / samples[k]
+        topic_words.append((samples[k], floor,
+                            dict((w, v / samples[k] + floor)
+                                 for w, v in zip(words, values))))
+    doc_topics = []
+    for d, (topics, values) in enumerate(doc_rows):
+        proportions = dict((k, smoothing[d] * weights[k] / (n * n))
+                           for k in range(num_topics))
+        for k, v in zip(topics, values):
+            proportions[k] += v / n
+        doc_topics.append(proportions)
+    return topic_words, doc_topics, num_samples
@@ -15,6 +15,7 @@ import re
 from senselearn.errors import ExperimentFail, WSIRepeat
 from senselearn.wsi_operator import INPUT_PATH, OUTPUT_DIR, OUTPUT_PREFIX
 from senselearn.wsi.default_runner import WSIRunner
+from senselearn.wsi.hdp_output import read_topic_counts, read_word_assignments
 
 STDOUT_SUFFIX = ".stdout"
 STDERR_SUFFIX = ".stderr"
@@ -29,7 +30,8 @@ HDP_OPTION_DEFAULTS = {
     "max_iter": "300",
     "save_lag": "-1",
     "gamma_b": "0.1",
-    "alpha_b": "1.0"
+    "alpha_b": "1.0",
+    "output_format": "bin"
 }
 
 SKIP_OPTIONS = (INPUT_PATH, OUTPUT_DIR, OUTPUT_PREFIX, EXE_PATH)
@@ -213,19 +215,29 @@ class HDPRunner(WSIRunner):
         :param time_taken: time taken to run HDP (stored as metadata)
         :return: dict containing HDP output and appropriate metadata
         """
-        # obtain topic distributions
-        topic_word_path = os.path.join(hdp_output_dir,
-                                       "mode-topics.dat")
-        if not os.path.exists(topic_word_path):
-            raise WSIRepeat("HDP fail (no topics-word file created)")
-        topic_word_counts = self._get_topic_word_counts(topic_word_path)
+        # obtain topic distributions, from the binary output if HDP wrote it
+        topic_word_path = os.path.join(hdp_output_dir, "mode-topics.bin")
+        if os.path.exists(topic_word_path):
+            topic_word_counts = self._get_topic_word_counts_bin(topic_word_path)
+        else:
+            topic_word_path = os.path.join(hdp_output_dir, "mode-topics.dat")
+            if not os.path.exists(topic_word_path):
+                raise WSIRepeat("HDP fail (no topics-word file created)")
+            topic_word_counts = self._get_topic_word_counts(topic_word_path)
 
         # obtain document distributions
         doc_topics_path = os.path.join(hdp_output_dir,
-                                       "mode-word-assignments.dat")
-        if not os.path.exists(doc_topics_path):
-            raise WSIRepeat("HDP fail (no docs-topic file created)")
-        doc_topic_counts = self.get_doc_topic_counts(doc_topics_path, non_empty)
+                                       "mode-word-assignments.bin")
+        if os.path.exists(doc_topics_path):
+            doc_topic_counts = self.get_doc_topic_counts_bin(doc_topics_path,
+                                                             non_empty)
+        else:
+            doc_topics_path = os.path.join(hdp_output_dir,
+                                           "mode-word-assignments.dat")
+            if not os.path.exists(doc_topics_path):
+                raise WSIRepeat("HDP fail (no docs-topic file created)")
+            doc_topic_counts = self.get_doc_topic_counts(doc_topics_path,
+                                                         non_empty)
 
         return {
             "time": time_taken,
@@ -257,6 +269,41 @@ class HDPRunner(WSIRunner):
         fp.close()
         return topic_word_counts
 
+    def _get_topic_word_counts_bin(self, topics_path):
+        """
+        Reads binary file containing topic-word counts
+
+        :param topics_path: path to topic-word counts file (*-topics.bin)
+        :return: dict mapping topic-ID to dict containing word counts
+        """
+        topic_word_counts = defaultdict(dict)
+        for topic_num, pairs in enumerate(read_topic_counts(topics_path)):
+            topic_id = "t_%02d" % topic_num
+            for word_id, count in pairs:
+                word = self.corpus.id_to_word(word_id)
+                topic_word_counts[topic_id][word] = count
+        return topic_word_counts
+
+    @staticmethod
+    def get_doc_topic_counts_bin(word_assignments_path, non_empty_list):
+        """
+        Reads binary file containing word assignments, as doc-topic counts
+
+        :param word_assignments_path: path to word assignments file
+            (*-word-assignments.bin)
+        :param non_empty_list: list of non-empty document ID's HDP was run on
+        :return: dict mapping doc-ID to dict containing topic counts
+        """
+        offsets, _, topics, _ = read_word_assignments(word_assignments_path)
+        doc_topic_counts = defaultdict(dict)
+        for d in range(len(offsets) - 1):
+            doc_id = "d_%06d" % non_empty_list[d]
+            counts = doc_topic_counts[doc_id]
+            for topic in topics[offsets[d]:offsets[d + 1]]:
+                topic_id = "t_%02d" % topic
+                counts[topic_id] = counts.get(topic_id, 0) + 1
+        return doc_topic_counts
+
     @staticmethod
     def get_doc_topic_counts(word_assignments_path, non_empty_list):
         """
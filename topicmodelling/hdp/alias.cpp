@@ -0,0 +1,65 @@
+#include "alias.h"
+#include "utils.h"
+
+alias_table::alias_table()
+{
+    m_total = 0.0;
+    m_num_draws = 0;
+}
+
+/// Vose's construction: bins below the mean weight are topped up by one
+/// bin above it, which is then put back on the list it now belongs to
+void alias_table::build(const double* weights, int n)
+{
+    m_weights.assign(weights, weights + n);
+    m_cutoff.resize(n);
+    m_alias.resize(n);
+    m_num_draws = 0;
+
+    int k;
+    m_total = 0.0;
+    for (k = 0; k < n; k++) m_total += weights[k];
+
+    vector<int> small, large;
+    for (k = 0; k < n; k++)
+    {
+        m_cutoff[k] = weights[k] * n / m_total;
+        m_alias[k] = k;
+        if (m_cutoff[k] < 1.0) small.push_back(k);
+        else large.push_back(k);
+    }
+    while (!small.empty() && !large.empty())
+    {
+        int s = small.back(); small.pop_back();
+        int l = large.back();
+        m_alias[s] = l;
+        m_cutoff[l] -= 1.0 - m_cutoff[s];
+        if (m_cutoff[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    /// what is left is 1 up to rounding
+    for (k = 0; k < (int)large.size(); k++) m_cutoff[large[k]] = 1.0;
+    for (k = 0; k < (int)small.size(); k++) m_cutoff[small[k]] = 1.0;
+}
+
+int alias_table::draw()
+{
+    m_num_draws ++;
+    int n = m_weights.size();
+    double u = runiform() * n;
+    int k = (int)u;
+    if (k >= n) k = n - 1;
+    return u - k < m_cutoff[k] ? k : m_alias[k];
+}
+
+void alias_table::clear()
+{
+    m_weights.clear();
+    m_cutoff.clear();
+    m_alias.clear();
+    m_total = 0.0;
+    m_num_draws = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <vector>
+using namespace std;
+
+/// a discrete distribution over 0..n-1 drawn from in O(1) by Walker's alias
+/// method. it keeps the weights it was built from, so the chance of drawing
+/// any k can be read back, and counts its draws, so a caller can rebuild it
+/// once it has been used as many times as building it cost.
+class alias_table
+{
+public:
+    alias_table();
+public:
+    void   build(const double* weights, int n);
+    int    draw();
+    void   clear();
+    int    size() const
+    {
+        return m_weights.size();
+    }
+    /// the chance of drawing k
+    double prob(int k) const
+    {
+        return m_weights[k] / m_total;
+    }
+    /// the weight of k, and the sum of the weights, it was built from
+    double weight(int k) const
+    {
+        return m_weights[k];
+    }
+    double total() const
+    {
+        return m_total;
+    }
+public:
+    int m_num_draws; // since it was built
+private:
+    vector<double> m_weights;
+    double         m_total;
+    vector<double> m_cutoff; // keep k if the uniform in bin k is below this
+    vector<int>    m_alias;  // otherwise take this one
+};
+
+#endif // ALIAS_H
@@ -0,0 +1,151 @@
+#include "state.h"
+#include "utils.h"
+#include <algorithm>
+
+/// the posterior averages of --burn_in, see average.bin in output.h. the sums
+/// are kept by averaged topic, and the topics of the sampler map to theirs by
+/// m_average->topic_of_z, which compact_hdp_state() keeps as it moves them.
+
+/// add the sorted keys and their values to the sorted row, in place: the
+/// row is widened by the keys it hasn't got, and filled from the back
+static void add_to_row(int_vec & row_keys, double_vec & row_values,
+                       const int_vec & keys, const double_vec & values)
+{
+    int n = row_keys.size(), m = keys.size();
+    int i, j, extra = 0;
+    for (i = 0, j = 0; j < m; j++)
+    {
+        while (i < n && row_keys[i] < keys[j]) i++;
+        if (i == n || row_keys[i] != keys[j]) extra++;
+    }
+    row_keys.resize(n + extra);
+    row_values.resize(n + extra);
+
+    int out = n + extra - 1;
+    for (i = n - 1, j = m - 1; j >= 0; out--)
+    {
+        if (i >= 0 && row_keys[i] > keys[j])
+        {
+            row_keys[out] = row_keys[i];
+            row_values[out] = row_values[i--];
+        }
+        else if (i >= 0 && row_keys[i] == keys[j])
+        {
+            row_keys[out] = keys[j];
+            row_values[out] = row_values[i--] + values[j--];
+        }
+        else
+        {
+            row_keys[out] = keys[j];
+            row_values[out] = values[j--];
+        }
+    }
+}
+
+/// start the sums of the iterations from burn_in on, with no samples yet
+void hdp_state::setup_average(int burn_in)
+{
+    delete m_average;
+    m_average = new posterior_average();
+    m_average->num_samples = 0;
+    m_average->iteration = 0;
+    m_average->burn_in = burn_in;
+    m_average->size_vocab = m_size_vocab;
+    m_average->doc_smoothing.assign(m_num_docs, 0.0);
+    m_average->doc_topics.resize(m_num_docs);
+    m_average->doc_values.resize(m_num_docs);
+}
+
+/// add the smoothed topic-word and doc-topic distributions of the state to
+/// the sums. a topic a merge emptied isn't added, the next compaction
+/// removes it
+void hdp_state::accumulate_average()
+{
+    posterior_average & average = *m_average;
+    int k, w;
+
+    if ((int)average.topic_of_z.size() < m_num_topics)
+        average.topic_of_z.resize(m_num_topics, -1);
+    double_vec inv_denom(m_num_topics, 0.0);
+    for (k = 0; k < m_num_topics; k++)
+    {
+        if (m_word_counts_by_z[k] == 0) continue;
+        int a = average.topic_of_z[k];
+        if (a < 0) // a topic born since the last sample
+        {
+            a = average.topic_of_z[k] = average.num_topics();
+            average.samples.push_back(0);
+            average.weights.push_back(0.0);
+            average.floors.push_back(0.0);
+            average.words.push_back(int_vec());
+            average.values.push_back(double_vec());
+        }
+        inv_denom[k] = 1.0 / (m_word_counts_by_z[k] + m_size_vocab * m_eta);
+        average.samples[a] ++;
+        average.weights[a] += m_num_tables_by_z[k] / (m_total_num_tables + m_gamma);
+        average.floors[a]  += m_eta * inv_denom[k];
+    }
+
+    /// the rows of the counts are by word, so the words of each topic come
+    /// in increasing order
+    vector <int_vec> words(m_num_topics);
+    vector <double_vec> values(m_num_topics);
+    for (w = 0; w < m_size_vocab; w++)
+    {
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        for (k = 0; k < m_num_topics; k++)
+            if (counts_w[k] > 0)
+            {
+                words[k].push_back(w);
+                values[k].push_back(counts_w[k] * inv_denom[k]);
+            }
+    }
+    for (k = 0; k < m_num_topics; k++)
+    {
+        if (words[k].empty()) continue;
+        int a = average.topic_of_z[k];
+        add_to_row(average.words[a], average.values[a], words[k], values[k]);
+    }
+
+    int_vec topics, counts, keys;
+    double_vec doc_values;
+    vector < pair<int, double> > entries;
+    for (int j = 0; j < m_num_docs; j++)
+    {
+        const doc_state* d_state = m_doc_states[j];
+        int d = d_state->m_doc_id;
+        double denom = d_state->m_doc_length + m_alpha;
+        average.doc_smoothing[d] += m_alpha / denom;
+
+        d_state->topic_counts(topics, counts);
+        entries.clear();
+        for (unsigned int i = 0; i < topics.size(); i++)
+            entries.push_back(make_pair(average.topic_of_z[topics[i]], counts[i] / denom));
+        sort(entries.begin(), entries.end());
+        keys.resize(entries.size());
+        doc_values.resize(entries.size());
+        for (unsigned int i = 0; i < entries.size(); i++)
+        {
+            keys[i] = entries[i].first;
+            doc_values[i] = entries[i].second;
+        }
+        add_to_row(average.doc_topics[d], average.doc_values[d], keys, doc_values);
+    }
+    average.num_samples ++;
+}
+
+/// write the sums after the iteration to a temporary file first, as the
+/// checkpoint is written
+void hdp_state::save_average(const char * name, int iteration)
+{
+    char temp[1000];
+    sprintf(temp, "%s.tmp", name);
+    m_average->iteration = iteration;
+    m_average->write(temp);
+    if (rename(temp, name) != 0)
+    {
+        printf("can't write %s.\n", name);
+        exit(1);
+    }
+    m_stats.bytes_written += file_size(name);
+}
@@ -0,0 +1,171 @@
+#include "batch.h"
+#include "hdp.h"
+#include "utils.h"
+#include "rng.h"
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+
+/// the models are handed out largest first from one queue: a thread that is
+/// done with a model takes the next one, so the small models fill in around
+/// the large ones, and the batch takes about as long as its largest model
+/// when there are enough threads.
+
+#define MAX_LINE 4096
+
+extern __thread gsl_rng * RANDOM_NUMBER;
+
+struct batch_queue
+{
+    vector <batch_job> * jobs;
+    const hdp_hyperparameter * hdp_param;
+    double eta;
+    int    init_topics;
+    bool   resume;
+    int    next;           // the next job to hand out
+    pthread_mutex_t mutex;
+};
+
+static bool larger_job(const batch_job & a, const batch_job & b)
+{
+    return a.size > b.size;
+}
+
+void read_manifest(const char * filename, long base_seed, vector <batch_job> & jobs)
+{
+    FILE * fileptr = fopen(filename, "r");
+    if (fileptr == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+
+    char line[MAX_LINE], data_path[MAX_LINE], directory[MAX_LINE];
+    long seed;
+    int line_num = 0;
+    while (fgets(line, MAX_LINE, fileptr) != NULL)
+    {
+        line_num ++;
+        int n = sscanf(line, "%s %s %ld", data_path, directory, &seed);
+        if (n <= 0 || data_path[0] == '#') continue;
+        if (n == 1)
+        {
+            printf("%s:%d, a model needs data and a directory.\n", filename, line_num);
+            exit(1);
+        }
+
+        batch_job job;
+        job.data_path = data_path;
+        job.directory = directory;
+        job.seed = (n == 3) ? seed : base_seed + (long)jobs.size();
+
+        struct stat st;
+        if (stat(data_path, &st) != 0)
+        {
+            printf("can't open %s.\n", data_path);
+            exit(1);
+        }
+        job.size = st.st_size;
+        jobs.push_back(job);
+    }
+    fclose(fileptr);
+}
+
+static void train_job(const batch_job & job, const batch_queue * queue)
+{
+    const char * directory = job.directory.c_str();
+    if (!dir_exists(directory))
+        mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR);
+
+    char name[500];
+    sprintf(name, "%s/hdp.log", directory);
+    FILE * log = fopen(name, queue->resume ? "a" : "w");
+    if (log == NULL)
+    {
+        printf("can't open %s.\n", name);
+        exit(1);
+    }
+
+    /// as main() does for a single model
+    gsl_rng_set(RANDOM_NUMBER, job.seed);
+
+    corpus * c = new corpus();
+    c->read_data(job.data_path.c_str());
+
+    hdp_hyperparameter hdp_param = *queue->hdp_param;
+    hdp_param.m_num_threads = 1;
+
+    hdp * hdp_instance = new hdp();
+    hdp_instance->setup_state(c, queue->eta, queue->init_topics, &hdp_param);
+    hdp_instance->m_state->m_log = log;
+    hdp_instance->m_run.seed = job.seed;
+
+    sprintf(name, "%s/checkpoint.bin", directory);
+    if (queue->resume && file_exists(name))
+    {
+        hdp_instance->resume(name);
+        gsl_rng_set(RANDOM_NUMBER, hdp_instance->m_run.seed);
+    }
+    hdp_instance->run(directory);
+
+    printf("%s: done, %d topics.\n", directory, hdp_instance->m_state->m_num_topics);
+
+    delete hdp_instance;
+    delete c;
+    fclose(log);
+}
+
+static void* run_batch_thread(void* arg)
+{
+    batch_queue* queue = (batch_queue*)arg;
+    RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_philox);
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        int j = queue->next ++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (j >= (int)queue->jobs->size()) break;
+
+        train_job((*queue->jobs)[j], queue);
+    }
+
+    gsl_rng_free(RANDOM_NUMBER);
+    RANDOM_NUMBER = NULL;
+    return NULL;
+}
+
+void run_batch(vector <batch_job> & jobs,
+               const hdp_hyperparameter * hdp_param,
+               double eta, int init_topics, int num_threads, bool resume)
+{
+    std::stable_sort(jobs.begin(), jobs.end(), larger_job);
+
+    batch_queue queue;
+    queue.jobs = &jobs;
+    queue.hdp_param = hdp_param;
+    queue.eta = eta;
+    queue.init_topics = init_topics;
+    queue.resume = resume;
+    queue.next = 0;
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    if (num_threads > (int)jobs.size()) num_threads = jobs.size();
+    if (num_threads < 1) num_threads = 1;
+
+    vector <pthread_t> threads(num_threads);
+    for (int p = 0; p < num_threads; p++)
+    {
+        if (pthread_create(&threads[p], NULL, run_batch_thread, &queue) != 0)
+        {
+            printf("can't create thread %d.\n", p);
+            exit(1);
+        }
+    }
+    for (int p = 0; p < num_threads; p++)
+        pthread_join(threads[p], NULL);
+
+    pthread_mutex_destroy(&queue.mutex);
+}
+
+// end of the file
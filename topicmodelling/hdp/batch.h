@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "state.h"
+#include <string>
+#include <sys/types.h>
+
+/// training many independent models in one process, --batch manifest.
+///
+/// every line of the manifest is one model,
+///   data directory [random_seed]
+/// and blank lines and lines starting with # are skipped. a model without a
+/// seed gets the --random_seed plus its line number among the models, so it
+/// has a stream of its own that doesn't depend on the other models, and
+/// trains exactly as it would with --algorithm train and that seed.
+
+struct batch_job
+{
+public:
+    std::string data_path;
+    std::string directory;
+    long   seed;
+    off_t  size; // of the data file, the larger models are started first
+};
+
+/// read the models of the manifest, in the order they are listed
+void read_manifest(const char * filename, long base_seed, vector <batch_job> & jobs);
+
+/// train every model of jobs, num_threads of them at a time, each with a
+/// single-threaded sampler. with resume, a model with a checkpoint in its
+/// directory continues from it.
+void run_batch(vector <batch_job> & jobs,
+               const hdp_hyperparameter * hdp_param,
+               double eta, int init_topics, int num_threads, bool resume);
+
+#endif // BATCH_H
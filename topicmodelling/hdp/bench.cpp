@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include "utils.h"
+#include "rng.h"
+#include "alias.h"
+#include "topic_kernel.h"
+#include "hdp.h"
+
+/// benchmarks of the hot paths of the sampler, see "make bench". each corpus,
+/// an LDA-C file or a synthetic one, is set up as for training and swept
+/// --iter times, with each phase of an iteration timed on its own. the
+/// results are written as one JSON object to --output.
+
+#define NUM_PHASES 6
+#define SPLIT_MERGE_TRIALS 15 // per iteration, as hdp::run() tries
+
+__thread gsl_rng * RANDOM_NUMBER;
+
+static const char * PHASE_NAMES[NUM_PHASES] =
+{
+    "sample_word_assignment",
+    "sample_tables",
+    "compact_hdp_state",
+    "joint_likelihood",
+    "save_state",
+    "split_merge_trial"
+};
+
+struct bench_corpus
+{
+    char name[500];
+    char path[500];
+    double init_seconds;
+    double seconds[NUM_PHASES];
+    int    calls[NUM_PHASES];
+    int    num_docs, size_vocab, total_words, num_topics, num_tables;
+    long   peak_rss_kb; // -1 when the peak can't be reset
+};
+
+/// the peak resident memory since reset_peak_rss() was last called, which
+/// resets this one as well, or of the whole run if it wasn't
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // in kilobytes on linux
+}
+
+/// give the freed memory back and reset the peak VmHWM to the resident
+/// memory now, so the peak of each corpus can be read on its own. false if
+/// the kernel doesn't let it be reset
+static bool reset_peak_rss()
+{
+    malloc_trim(0);
+    FILE * file = fopen("/proc/self/clear_refs", "w");
+    if (file == NULL) return false;
+    bool reset = fputs("5", file) >= 0;
+    if (fclose(file) != 0) reset = false;
+    return reset;
+}
+
+/// VmHWM, the peak resident memory since reset_peak_rss(), or -1
+static long peak_rss_since_reset_kb()
+{
+    FILE * file = fopen("/proc/self/status", "r");
+    if (file == NULL) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(file);
+    return kb;
+}
+
+/// num_docs documents of uniformly num_words/2 to 3*num_words/2 words drawn
+/// from a Zipf law of exponent skew over size_vocab words, in the LDA-C
+/// format. the frequent words are spread over the word ids.
+static void write_synthetic(const char * filename, int num_docs, int size_vocab,
+                            int num_words, double skew)
+{
+    FILE * file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+
+    int_vec ids(size_vocab);
+    double_vec weights(size_vocab);
+    int w, d, i;
+    for (w = 0; w < size_vocab; w++)
+    {
+        ids[w] = w;
+        weights[w] = pow(w + 1.0, -skew);
+    }
+    rshuffle(&ids[0], size_vocab, sizeof(int));
+    alias_table zipf;
+    zipf.build(&weights[0], size_vocab);
+
+    int_vec counts(size_vocab, 0), words;
+    for (d = 0; d < num_docs; d++)
+    {
+        int length = num_words/2 + runiform_int(num_words + 1);
+        words.clear();
+        for (i = 0; i < length; i++)
+        {
+            w = ids[zipf.draw()];
+            if (counts[w] == 0) words.push_back(w);
+            counts[w] ++;
+        }
+        fprintf(file, "%d", (int)words.size());
+        for (i = 0; i < (int)words.size(); i++)
+        {
+            fprintf(file, " %d:%d", words[i], counts[words[i]]);
+            counts[words[i]] = 0;
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+static void bench(bench_corpus & b, hdp_hyperparameter * hdp_param, double eta,
+                  int init_topics, int num_iter, const char * directory)
+{
+    corpus * c = new corpus();
+    bool peak_reset = reset_peak_rss();
+    c->read_data(b.path);
+
+    hdp * hdp_instance = new hdp();
+    hdp_instance->setup_state(c, eta, init_topics, hdp_param);
+    hdp_state * state = hdp_instance->m_state;
+
+    double start, t;
+    int p, j;
+    for (p = 0; p < NUM_PHASES; p++)
+    {
+        b.seconds[p] = 0.0;
+        b.calls[p] = 0;
+    }
+
+    rstream(0);
+    start = wall_time();
+    hdp_instance->init_state();
+    b.init_seconds = wall_time() - start;
+
+    char name[500];
+    sprintf(name, "%s/bench", directory);
+    double_vec q, f;
+    vector <sm_move> moves(1);
+    for (int iter = 0; iter < num_iter; iter++)
+    {
+        rstream(iter + 1);
+        if (state->sparse_sampler() && state->m_sparse_dirty)
+            state->rebuild_sparse_state();
+
+        start = wall_time();
+        state->sweep_docs(true, false);
+        t = wall_time(); b.seconds[0] += t - start; b.calls[0] ++; start = t;
+
+        for (j = 0; j < state->m_num_docs; j++)
+            state->sample_tables(state->m_doc_states[j], q, f);
+        t = wall_time(); b.seconds[1] += t - start; b.calls[1] ++; start = t;
+
+        state->compact_hdp_state();
+        t = wall_time(); b.seconds[2] += t - start; b.calls[2] ++; start = t;
+
+        double likelihood = state->joint_likelihood(hdp_param);
+        t = wall_time(); b.seconds[3] += t - start; b.calls[3] ++; start = t;
+
+        state->save_state(name);
+        t = wall_time(); b.seconds[4] += t - start; b.calls[4] ++; start = t;
+
+        /// the moves are scored but not taken, so each iteration samples
+        /// the same chain as without them
+        for (j = 0; j < SPLIT_MERGE_TRIALS; j++)
+        {
+            sm_move & move = moves[0];
+            state->select_mcmc_move(move.d0, move.d1, move.t0, move.t1);
+            state->seed_move(move);
+            state->evaluate_moves(moves, hdp_param->m_num_restricted_scans);
+        }
+        t = wall_time(); b.seconds[5] += t - start; b.calls[5] += SPLIT_MERGE_TRIALS;
+
+        printf("%s: iter = %05d, #topics = %04d, #tables = %04d, likelihood = %.5f\n",
+                b.name, iter, state->m_num_topics, state->m_total_num_tables, likelihood);
+    }
+
+    b.num_docs = c->num_docs;
+    b.size_vocab = c->size_vocab;
+    b.total_words = c->total_words;
+    b.num_topics = state->m_num_topics;
+    b.num_tables = state->m_total_num_tables;
+    b.peak_rss_kb = peak_reset ? peak_rss_since_reset_kb() : -1;
+
+    delete hdp_instance;
+    delete c;
+}
+
+/// a JSON string, the names are file names
+static void print_string(FILE * file, const char * s)
+{
+    fputc('"', file);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') fputc('\\', file);
+        if ((unsigned char)*s < 0x20) fprintf(file, "\\u%04x", *s);
+        else fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+static void print_results(FILE * file, const vector <bench_corpus> & results,
+                          const char * sampler, int num_iter, long seed)
+{
+    fprintf(file, "{\n  \"sampler\": \"%s\",\n  \"kernel\": \"%s\",\n  \"iterations\": %d,\n  \"random_seed\": %ld,\n",
+            sampler, topic_kernel_name(), num_iter, seed);
+    long peak = peak_rss_kb();
+    for (unsigned int j = 0; j < results.size(); j++)
+        if (results[j].peak_rss_kb > peak) peak = results[j].peak_rss_kb;
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n  \"corpora\": [", peak);
+    for (unsigned int j = 0; j < results.size(); j++)
+    {
+        const bench_corpus & b = results[j];
+        double sweep = b.seconds[0] + b.seconds[1] + b.seconds[2];
+        fprintf(file, "%s\n    {\n      \"name\": ", j == 0 ? "" : ",");
+        print_string(file, b.name);
+        fprintf(file, ",\n      \"docs\": %d,\n      \"vocab\": %d,\n      \"tokens\": %d,\n",
+                b.num_docs, b.size_vocab, b.total_words);
+        fprintf(file, "      \"topics\": %d,\n      \"tables\": %d,\n", b.num_topics, b.num_tables);
+        fprintf(file, "      \"init_seconds\": %.6f,\n", b.init_seconds);
+        fprintf(file, "      \"tokens_per_sec\": %.1f,\n",
+                sweep > 0.0 ? (double)b.total_words * b.calls[0] / sweep : 0.0);
+        fprintf(file, "      \"peak_rss_kb\": %ld,\n      \"phases\": {", b.peak_rss_kb);
+        for (int p = 0; p < NUM_PHASES; p++)
+        {
+            fprintf(file, "%s\n        \"%s\": {\"seconds\": %.6f, \"calls\": %d, \"seconds_per_call\": %.9f",
+                    p == 0 ? "" : ",", PHASE_NAMES[p], b.seconds[p], b.calls[p],
+                    b.calls[p] > 0 ? b.seconds[p] / b.calls[p] : 0.0);
+            if (p == 0)
+                fprintf(file, ", \"tokens_per_sec\": %.1f",
+                        b.seconds[p] > 0.0 ? (double)b.total_words * b.calls[p] / b.seconds[p] : 0.0);
+            fprintf(file, "}");
+        }
+        fprintf(file, "\n      }\n    }");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+static void print_usage_and_exit()
+{
+    printf("\nbenchmarks of the hdp sampler, the results as JSON.\n");
+    printf("usage:\n");
+    printf("      hdp_bench [options]\n");
+    printf("      --data:           a corpus in lda-c format, may be repeated\n");
+    printf("      --synthetic:      D V L skew, a corpus of D documents of L words on average,\n");
+    printf("                        drawn from a Zipf law of exponent skew over V words, may be repeated\n");
+    printf("      --directory:      where the synthetic corpora and the saved states go, default \".\"\n");
+    printf("      --output:         the JSON file, default \"bench.json\"\n");
+    printf("      --iter:           the number of iterations timed for each corpus, default 5\n");
+    printf("      --sampler:        word sampler, dense, sparse or alias, default \"dense\"\n");
+    printf("      --init_topics:    the initial number of topics, default 0\n");
+    printf("      --eta:            topic Dirichlet parameter, default 0.5\n");
+    printf("      --restrict_scan:  number of intermediate scans of a split-merge trial, default 5\n");
+    printf("      --random_seed:    the random seed, default 1\n");
+    printf("\nexample:\n");
+    printf("      ./hdp_bench --data ../HCA-0.61/data/ch.ldac --synthetic 2000 5000 100 1.0\n");
+    printf("\n");
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || !strcmp(argv[1], "-help") || !strcmp(argv[1], "--help") ||
+            !strcmp(argv[1], "-h") || !strcmp(argv[1], "--usage"))
+    {
+        print_usage_and_exit();
+    }
+
+    int num_iter = 5, init_topics = 0, num_restricted_scan = 5;
+    int sampler = DENSE_SAMPLER;
+    const char * sampler_name = "dense";
+    double eta = 0.5;
+    long seed = 1;
+    const char * directory = ".";
+    const char * output_path = "bench.json";
+    vector <bench_corpus> corpora;
+    bench_corpus b;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--data") && i + 1 < argc)
+        {
+            ++i;
+            const char * base = strrchr(argv[i], '/');
+            snprintf(b.name, sizeof(b.name), "%s", base == NULL ? argv[i] : base + 1);
+            if (snprintf(b.path, sizeof(b.path), "%s", argv[i]) >= (int)sizeof(b.path))
+            {
+                printf("%s, path too long, exit\n", argv[i]);
+                exit(1);
+            }
+            corpora.push_back(b);
+        }
+        else if (!strcmp(argv[i], "--synthetic") && i + 4 < argc)
+        {
+            /// the path is set once the directory is known
+            snprintf(b.name, sizeof(b.name), "synthetic-%d-%d-%d-%g",
+                     atoi(argv[i+1]), atoi(argv[i+2]), atoi(argv[i+3]), atof(argv[i+4]));
+            b.path[0] = '\0';
+            corpora.push_back(b);
+            i += 4;
+        }
+        else if (!strcmp(argv[i], "--directory") && i + 1 < argc)   directory = argv[++i];
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)      output_path = argv[++i];
+        else if (!strcmp(argv[i], "--iter") && i + 1 < argc)        num_iter = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--init_topics") && i + 1 < argc) init_topics = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--eta") && i + 1 < argc)         eta = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--restrict_scan") && i + 1 < argc) num_restricted_scan = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--random_seed") && i + 1 < argc) seed = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--sampler") && i + 1 < argc)
+        {
+            ++i;
+            if (!strcmp(argv[i], "sparse") ||  !strcmp(argv[i], "SPARSE"))
+            {
+                sampler = SPARSE_SAMPLER;
+                sampler_name = "sparse";
+            }
+            else if (!strcmp(argv[i], "alias") ||  !strcmp(argv[i], "ALIAS"))
+            {
+                sampler = ALIAS_SAMPLER;
+                sampler_name = "alias";
+            }
+        }
+        else
+        {
+            printf("%s, unknown parameters, exit\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (corpora.empty())
+    {
+        printf("no corpus to benchmark, use --data or --synthetic.\n");
+        exit(1);
+    }
+
+    if (!dir_exists(directory))
+        mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR);
+
+    RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_philox);
+
+    hdp_hyperparameter * hdp_param = new hdp_hyperparameter();
+    hdp_param->setup_parameters(1.0, 1.0, 1.0, 1.0, num_iter, -1,
+                                num_restricted_scan, false, true, sampler, 1,
+                                TEXT_OUTPUT);
+
+    for (unsigned int j = 0; j < corpora.size(); j++)
+    {
+        bench_corpus & c = corpora[j];
+        gsl_rng_set(RANDOM_NUMBER, seed);
+        if (c.path[0] == '\0')
+        {
+            int num_docs, size_vocab, num_words;
+            double skew;
+            sscanf(c.name, "synthetic-%d-%d-%d-%lf", &num_docs, &size_vocab, &num_words, &skew);
+            if (snprintf(c.path, sizeof(c.path), "%s/%s.ldac", directory, c.name) >= (int)sizeof(c.path))
+            {
+                printf("%s, path too long, exit\n", directory);
+                exit(1);
+            }
+            rng_set_stream(RANDOM_NUMBER, 0, 1); // apart from the sampler's streams
+            write_synthetic(c.path, num_docs, size_vocab, num_words, skew);
+        }
+        bench(c, hdp_param, eta, init_topics, num_iter, directory);
+    }
+
+    FILE * file = fopen(output_path, "w");
+    if (file == NULL)
+    {
+        printf("can't open %s.\n", output_path);
+        exit(1);
+    }
+    print_results(file, corpora, sampler_name, num_iter, seed);
+    fclose(file);
+
+    delete hdp_param;
+    gsl_rng_free(RANDOM_NUMBER);
+    return 0;
+}
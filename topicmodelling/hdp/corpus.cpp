@@ -4,6 +4,12 @@
 //
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "corpus.h"
 
 corpus::corpus()
@@ -11,23 +17,45 @@ corpus::corpus()
     size_vocab = 0;
     total_words = 0;
     num_docs = 0;
+    m_map = NULL;
+    m_map_size = 0;
 }
 
 corpus::~corpus()
 {
-    for (int i = 0; i < num_docs; i++)
-    {
-        document * doc = docs[i];
-        delete doc;
-    }
     docs.clear();
+    if (m_map != NULL) munmap(m_map, m_map_size);
+    m_map = NULL;
 
     size_vocab = 0;
     num_docs = 0;
     total_words = 0;
 }
 
+/// read either format, a binary corpus is told by its magic
 void corpus::read_data(const char * filename)
+{
+    corpus_header header;
+    FILE * fileptr = fopen(filename, "rb");
+    if (fileptr == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+    size_t n = fread(header.magic, 1, sizeof(header.magic), fileptr);
+    fclose(fileptr);
+
+    if (n == sizeof(header.magic) && memcmp(header.magic, CORPUS_MAGIC, n) == 0)
+        read_binary(filename);
+    else
+        read_text(filename);
+
+    printf("number of docs  : %d\n", num_docs);
+    printf("number of terms : %d\n", size_vocab);
+    printf("number of total words : %d\n", total_words);
+}
+
+void corpus::read_text(const char * filename)
 {
     int OFFSET = 0;
     FILE * fileptr;
@@ -39,32 +67,146 @@ void corpus::read_data(const char * filename)
     fileptr = fopen(filename, "r");
     nd = 0;
     nw = 0;
+    m_offsets.push_back(0);
     while ((fscanf(fileptr, "%10d", &length) != EOF))
     {
-        document * doc = new document(length);
         for (n = 0; n < length; n++)
         {
             fscanf(fileptr, "%10d:%10d", &word, &count);
             word = word - OFFSET;
-            doc->words[n] = word;
-            doc->counts[n] = count;
-            doc->total += count;
+            m_words.push_back(word);
+            m_counts.push_back(count);
+            total_words += count;
             if (word >= nw)
             {
                 nw = word + 1;
             }
         }
-        total_words += doc->total;
-        doc->id = nd;
-        docs.push_back(doc);
+        m_offsets.push_back(m_words.size());
         nd++;
     }
     fclose(fileptr); // close the file
     num_docs = nd;
     size_vocab = nw;
-    printf("number of docs  : %d\n", nd);
-    printf("number of terms : %d\n", nw);
-    printf("number of total words : %d\n", total_words);
+
+    setup_docs(&m_offsets[0],
+               m_words.empty() ? NULL : &m_words[0],
+               m_counts.empty() ? NULL : &m_counts[0]);
+}
+
+void corpus::read_binary(const char * filename)
+{
+    printf("\nmapping binary data from %s\n", filename);
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+    m_map_size = st.st_size;
+    m_map = mmap(NULL, m_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = NULL;
+        printf("can't map %s.\n", filename);
+        exit(1);
+    }
+
+    const corpus_header * header = (const corpus_header *)m_map;
+    const char * data = (const char *)m_map + sizeof(corpus_header);
+    bool ok = m_map_size >= sizeof(corpus_header) &&
+              memcmp(header->magic, CORPUS_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == CORPUS_VERSION &&
+              header->num_docs >= 0 && header->size_vocab >= 0 &&
+              header->total_words >= 0 && header->total_words <= INT_MAX &&
+              header->num_entries >= 0 &&
+              header->num_entries <= (int64_t)(m_map_size / (2 * sizeof(int)));
+    ok = ok && m_map_size == sizeof(corpus_header) + sizeof(int64_t) * (header->num_docs + 1) +
+                             sizeof(int) * 2 * header->num_entries;
+
+    /// the offsets start at 0, don't decrease and end at num_entries; the
+    /// words are in the vocabulary and the counts add up to total_words
+    const int64_t * offsets = (const int64_t *)data;
+    const int * words = NULL;
+    const int * counts = NULL;
+    if (ok)
+    {
+        words = (const int *)(offsets + header->num_docs + 1);
+        counts = words + header->num_entries;
+        ok = offsets[0] == 0 && offsets[header->num_docs] == header->num_entries;
+        for (int d = 0; ok && d < header->num_docs; d++)
+            ok = offsets[d] <= offsets[d+1];
+        int64_t total = 0;
+        for (int64_t n = 0; ok && n < header->num_entries; n++)
+        {
+            ok = words[n] >= 0 && words[n] < header->size_vocab && counts[n] >= 0;
+            total += counts[n];
+        }
+        ok = ok && total == header->total_words;
+    }
+    if (!ok)
+    {
+        printf("%s is not a binary corpus of version %d.\n", filename, CORPUS_VERSION);
+        exit(1);
+    }
+
+    num_docs = header->num_docs;
+    size_vocab = header->size_vocab;
+    total_words = header->total_words;
+
+    setup_docs(offsets, words, counts);
+}
+
+void corpus::setup_docs(const int64_t * offsets, const int * words, const int * counts)
+{
+    docs.resize(num_docs);
+    for (int d = 0; d < num_docs; d++)
+    {
+        document & doc = docs[d];
+        doc.words  = words + offsets[d];
+        doc.counts = counts + offsets[d];
+        doc.length = offsets[d+1] - offsets[d];
+        doc.total  = 0;
+        for (int n = 0; n < doc.length; n++) doc.total += doc.counts[n];
+        doc.id     = d;
+    }
+}
+
+void corpus::write_binary(const char * filename) const
+{
+    FILE * fileptr = fopen(filename, "wb");
+    if (fileptr == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+
+    corpus_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORPUS_MAGIC, sizeof(header.magic));
+    header.version = CORPUS_VERSION;
+    header.num_docs = num_docs;
+    header.size_vocab = size_vocab;
+    header.total_words = total_words;
+    header.num_entries = 0;
+    for (int d = 0; d < num_docs; d++) header.num_entries += docs[d].length;
+    fwrite(&header, sizeof(header), 1, fileptr);
+
+    int64_t offset = 0;
+    fwrite(&offset, sizeof(offset), 1, fileptr);
+    for (int d = 0; d < num_docs; d++)
+    {
+        offset += docs[d].length;
+        fwrite(&offset, sizeof(offset), 1, fileptr);
+    }
+    for (int d = 0; d < num_docs; d++)
+        fwrite(docs[d].words, sizeof(int), docs[d].length, fileptr);
+    for (int d = 0; d < num_docs; d++)
+        fwrite(docs[d].counts, sizeof(int), docs[d].length, fileptr);
+    fclose(fileptr);
 }
 
 // end of the file
@@ -3,13 +3,15 @@
 
 #include <vector>
 #include <cstddef>
+#include <stdint.h>
 using namespace std;
 
+/// a document points into the word and count arrays of its corpus
 class document
 {
 public:
-    int * words;
-    int * counts;
+    const int * words;
+    const int * counts;
     int length;
     int total;
     int id;
@@ -22,25 +24,26 @@ public:
         total = 0;
         id = -1;
     }
-    document(int len)
-    {
-        length = len;
-        words = new int [length];
-        counts = new int [length];
-        total = 0;
-        id = -1;
-    }
-    ~ document()
-    {
-        if (words != NULL)
-        {
-            delete [] words;
-            delete [] counts;
-            length = 0;
-            total = 0;
-            id = -1;
-        }
-    }
+};
+
+/// binary corpus format, in the byte order of the machine that wrote it:
+///   header  : corpus_header below
+///   offsets : num_docs+1 int64, doc d owns entries [offsets[d], offsets[d+1])
+///   words   : num_entries int32 word ids
+///   counts  : num_entries int32 counts
+/// the file is mapped as it is, so the arrays are used without copying.
+#define CORPUS_MAGIC "HDPCSR\0\0"
+#define CORPUS_VERSION 1
+
+struct corpus_header
+{
+    char    magic[8];
+    int32_t version;
+    int32_t num_docs;
+    int32_t size_vocab;
+    int32_t reserved;
+    int64_t total_words;
+    int64_t num_entries;
 };
 
 class corpus
@@ -49,12 +52,23 @@ public:
     corpus();
     ~corpus();
     void read_data(const char * filename);
+    void write_binary(const char * filename) const;
 public:
     int size_vocab;
     int total_words;
     int num_docs;
-    vector<document*> docs;
+    vector<document> docs;
+private:
+    void read_text(const char * filename);
+    void read_binary(const char * filename);
+    void setup_docs(const int64_t * offsets, const int * words, const int * counts);
+
+    /// the entries of a text corpus, or the mapping of a binary one
+    vector<int64_t> m_offsets;
+    vector<int> m_words;
+    vector<int> m_counts;
+    void * m_map;
+    size_t m_map_size;
 };
 
 #endif	/* _CORPUS_H */
-
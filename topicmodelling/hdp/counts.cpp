@@ -0,0 +1,273 @@
+#include "counts.h"
+#include <string.h>
+#include <assert.h>
+
+#define ROW_ALIGN 8 // round rows up to a multiple of 8 ints (32 bytes)
+#define ROWS_PER_BLOCK 1024 // private rows are allocated this many at a time
+
+static int round_capacity(int num_topics)
+{
+    if (num_topics < 1) num_topics = 1;
+    return (num_topics + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+}
+
+word_topic_counts::word_topic_counts()
+{
+    m_size_vocab = 0;
+    m_capacity = 0;
+    m_counts = NULL;
+    m_rows = NULL;
+    m_base = NULL;
+    m_num_private = 0;
+    m_tracking = false;
+    m_num_base_topics = 0;
+}
+
+word_topic_counts::~word_topic_counts()
+{
+    free_counts();
+}
+
+void word_topic_counts::set_rows()
+{
+    delete [] m_rows;
+    m_rows = new int* [m_size_vocab > 0 ? m_size_vocab : 1];
+    for (int w = 0; w < m_size_vocab; w++)
+        m_rows[w] = m_counts + (size_t)w * m_capacity;
+}
+
+void word_topic_counts::allocate(int size_vocab, int num_topics)
+{
+    free_counts();
+    m_size_vocab = size_vocab;
+    m_capacity = round_capacity(num_topics);
+    size_t size = (size_t)m_size_vocab * m_capacity;
+    m_counts = new int [size];
+    memset(m_counts, 0, sizeof(int)*size);
+    set_rows();
+}
+
+/// make room for at least num_topics topics in every row. the capacity is
+/// doubled, so creating topics one at a time costs amortised O(V) each.
+void word_topic_counts::reserve(int num_topics)
+{
+    if (num_topics <= m_capacity) return;
+    assert(m_base == NULL);
+
+    int capacity = round_capacity(num_topics > 2 * m_capacity ? num_topics : 2 * m_capacity);
+    size_t size = (size_t)m_size_vocab * capacity;
+    int* counts = new int [size];
+    memset(counts, 0, sizeof(int)*size);
+    for (int w = 0; w < m_size_vocab; w++)
+        memcpy(counts + (size_t)w * capacity, row(w), sizeof(int)*m_capacity);
+
+    delete [] m_counts;
+    m_counts = counts;
+    m_capacity = capacity;
+    set_rows();
+}
+
+void word_topic_counts::free_blocks()
+{
+    for (unsigned int b = 0; b < m_blocks.size(); b++)
+        delete [] m_blocks[b];
+    m_blocks.clear();
+    m_num_private = 0;
+    m_private_words.clear();
+}
+
+void word_topic_counts::free_counts()
+{
+    free_blocks();
+    delete [] m_counts;
+    delete [] m_rows;
+    m_counts = NULL;
+    m_rows = NULL;
+    m_base = NULL;
+    m_size_vocab = 0;
+    m_capacity = 0;
+
+    m_tracking = false;
+    m_num_base_topics = 0;
+    m_change_of_w.clear();
+    m_changes.clear();
+    m_pool.clear();
+    m_pool_words.clear();
+    m_pool_row_of_w.clear();
+}
+
+void word_topic_counts::copy(const word_topic_counts & src)
+{
+    assert(src.m_base == NULL);
+    if (m_base != NULL || m_size_vocab != src.m_size_vocab || m_capacity != src.m_capacity)
+    {
+        free_counts();
+        m_size_vocab = src.m_size_vocab;
+        m_capacity = src.m_capacity;
+        m_counts = new int [(size_t)m_size_vocab * m_capacity];
+        set_rows();
+    }
+    memcpy(m_counts, src.m_counts, sizeof(int)*(size_t)m_size_vocab * m_capacity);
+}
+
+/// move topic k to k_to_new_k[k] in every row (k_to_new_k[k] <= k, or -1 for
+/// a removed topic), and clear the topics beyond num_topics_new.
+void word_topic_counts::compact(const int* k_to_new_k, int num_topics_old, int num_topics_new)
+{
+    for (int w = 0; w < m_size_vocab; w++)
+    {
+        int* counts = row(w);
+        for (int k = 0; k < num_topics_old; k++)
+        {
+            if (k_to_new_k[k] >= 0) counts[k_to_new_k[k]] = counts[k];
+        }
+        for (int k = num_topics_new; k < num_topics_old; k++)
+            counts[k] = 0;
+    }
+}
+
+/// copy out the counts of topic k, counts has m_size_vocab entries
+void word_topic_counts::get_topic(int k, int* counts) const
+{
+    for (int w = 0; w < m_size_vocab; w++)
+        counts[w] = (*this)(w, k);
+}
+
+void word_topic_counts::set_topic(int k, const int* counts)
+{
+    for (int w = 0; w < m_size_vocab; w++)
+        (*this)(w, k) = counts[w];
+}
+
+/// read every row from base until make_private() is called for it. calling
+/// it again drops the private rows, but keeps their storage for reuse.
+void word_topic_counts::overlay(const word_topic_counts * base)
+{
+    if (m_base != base || m_tracking || m_size_vocab != base->m_size_vocab ||
+        m_capacity != base->m_capacity)
+    {
+        free_counts();
+        m_size_vocab = base->m_size_vocab;
+        m_capacity = base->m_capacity;
+        m_rows = new int* [m_size_vocab > 0 ? m_size_vocab : 1];
+        m_base = base;
+    }
+    for (int w = 0; w < m_size_vocab; w++)
+        m_rows[w] = m_base->m_rows[w];
+    m_num_private = 0;
+    m_private_words.clear();
+}
+
+/// copy the row of w from the base, so it can be written. when tracking,
+/// the row must be loaded, and w is added to the words whose changes are kept
+int* word_topic_counts::make_private(int w)
+{
+    if (is_private(w)) return m_rows[w];
+
+    if (m_tracking)
+    {
+        assert(m_pool_row_of_w[w] >= 0);
+        m_change_of_w[w] = m_private_words.size();
+        m_private_words.push_back(w);
+        if (m_changes.size() < m_private_words.size()) m_changes.push_back(vector <int>());
+        return m_rows[w];
+    }
+
+    int b = m_num_private / ROWS_PER_BLOCK;
+    if (b == (int)m_blocks.size())
+        m_blocks.push_back(new int [(size_t)ROWS_PER_BLOCK * m_capacity]);
+    int* counts = m_blocks[b] + (size_t)(m_num_private % ROWS_PER_BLOCK) * m_capacity;
+    memcpy(counts, m_base->m_rows[w], sizeof(int)*m_capacity);
+
+    m_rows[w] = counts;
+    m_num_private ++;
+    m_private_words.push_back(w);
+    return counts;
+}
+
+/// keep the changes to base, with rows of num_topics topics, the topics from
+/// num_base_topics up being new to this store. calling it again drops the
+/// changes, but keeps their storage for reuse.
+void word_topic_counts::track(const word_topic_counts * base, int num_base_topics, int num_topics)
+{
+    if (m_base != base || !m_tracking || m_size_vocab != base->m_size_vocab)
+    {
+        free_counts();
+        m_size_vocab = base->m_size_vocab;
+        m_rows = new int* [m_size_vocab > 0 ? m_size_vocab : 1];
+        m_base = base;
+        m_tracking = true;
+        m_change_of_w.assign(m_size_vocab, -1);
+        m_pool_row_of_w.assign(m_size_vocab, -1);
+    }
+    for (unsigned int j = 0; j < m_private_words.size(); j++)
+    {
+        m_change_of_w[m_private_words[j]] = -1;
+        m_changes[j].clear();
+    }
+    m_private_words.clear();
+
+    m_capacity = round_capacity(num_topics);
+    m_num_base_topics = num_base_topics;
+    for (int w = 0; w < m_size_vocab; w++)
+        m_rows[w] = m_base->m_rows[w];
+}
+
+/// make full rows, the base counts plus the changes so far, for the words
+/// of a document; the samplers read and write only these until save_rows()
+void word_topic_counts::load_rows(const uint32_t* words, int num_words)
+{
+    assert(m_tracking && m_pool_words.empty());
+    int i, j, k;
+    for (i = 0; i < num_words; i++)
+    {
+        int w = words[i];
+        if (m_pool_row_of_w[w] >= 0) continue;
+        m_pool_row_of_w[w] = m_pool_words.size();
+        m_pool_words.push_back(w);
+    }
+
+    size_t size = m_pool_words.size() * (size_t)m_capacity;
+    if (m_pool.size() < size) m_pool.resize(size);
+    for (j = 0; j < (int)m_pool_words.size(); j++)
+    {
+        int w = m_pool_words[j];
+        int* counts = &m_pool[0] + (size_t)j * m_capacity;
+        memcpy(counts, m_base->m_rows[w], sizeof(int)*m_num_base_topics);
+        memset(counts + m_num_base_topics, 0, sizeof(int)*(m_capacity - m_num_base_topics));
+        if (m_change_of_w[w] >= 0)
+        {
+            const vector <int> & changes = m_changes[m_change_of_w[w]];
+            for (k = 0; k < (int)changes.size(); k += 2)
+                counts[changes[k]] += changes[k+1];
+        }
+        m_rows[w] = counts;
+    }
+}
+
+/// keep the nonzero changes of the rows written since load_rows(), and read
+/// every row from the base again
+void word_topic_counts::save_rows()
+{
+    for (unsigned int j = 0; j < m_pool_words.size(); j++)
+    {
+        int w = m_pool_words[j];
+        if (m_change_of_w[w] >= 0)
+        {
+            const int* counts = m_rows[w];
+            const int* base_w = m_base->m_rows[w];
+            vector <int> & changes = m_changes[m_change_of_w[w]];
+            changes.clear();
+            for (int k = 0; k < m_capacity; k++)
+            {
+                int change = counts[k] - (k < m_num_base_topics ? base_w[k] : 0);
+                if (change == 0) continue;
+                changes.push_back(k);
+                changes.push_back(change);
+            }
+        }
+        m_rows[w] = m_base->m_rows[w];
+        m_pool_row_of_w[w] = -1;
+    }
+    m_pool_words.clear();
+}
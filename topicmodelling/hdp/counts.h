@@ -0,0 +1,88 @@
+#ifndef COUNTS_H
+#define COUNTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+/// word-topic counts stored word-major: each word owns one contiguous row
+/// of m_capacity topic counts, so the K counts the samplers read for a word
+/// sit in a single run of memory. rows are widened as topics are created.
+///
+/// a store can also overlay another one (see overlay()): rows are read from
+/// the base store until they are first written, and then copied into rows
+/// private to the overlay. this is what the split-merge proposals use.
+///
+/// or it can track the changes to another one (see track()), as the workers
+/// of a parallel sweep do: the words written keep only their nonzero changes,
+/// and full rows are made for the words of one document at a time.
+class word_topic_counts
+{
+public:
+    int   m_size_vocab;
+    int   m_capacity;  // number of topics each row has room for
+    int * m_counts;    // [word][topic], owned rows
+    int** m_rows;      // where the row of each word is
+
+/// overlay
+    const word_topic_counts * m_base;
+    vector <int*> m_blocks;       // storage for the private rows
+    int           m_num_private;  // number of private rows in use
+    vector <int>  m_private_words;
+
+/// tracking
+    bool          m_tracking;
+    int           m_num_base_topics;  // topics of the base when track() was called
+    vector <int>  m_change_of_w;      // index of each word in m_private_words, or -1
+    vector < vector <int> > m_changes;  // of each word written, pairs of topic and change
+    vector <int>  m_pool;             // the rows made by load_rows()
+    vector <int>  m_pool_words;
+    vector <int>  m_pool_row_of_w;    // -1 for the words not loaded
+
+public:
+    word_topic_counts();
+    virtual ~word_topic_counts();
+public:
+    void allocate(int size_vocab, int num_topics);
+    void reserve(int num_topics);
+    void free_counts();
+    void copy(const word_topic_counts & src);
+    void compact(const int* k_to_new_k, int num_topics_old, int num_topics_new);
+    void get_topic(int k, int* counts) const;
+    void set_topic(int k, const int* counts);
+
+    void overlay(const word_topic_counts * base);
+    int* make_private(int w);
+    bool is_private(int w) const
+    {
+        if (m_tracking) return m_change_of_w[w] >= 0;
+        return m_base == NULL || m_rows[w] != m_base->m_rows[w];
+    }
+
+    void track(const word_topic_counts * base, int num_base_topics, int num_topics);
+    void load_rows(const uint32_t* words, int num_words);
+    void save_rows();
+
+    int* row(int w)
+    {
+        return m_rows[w];
+    }
+    const int* row(int w) const
+    {
+        return m_rows[w];
+    }
+    int& operator()(int w, int k)
+    {
+        return m_rows[w][k];
+    }
+    int operator()(int w, int k) const
+    {
+        return m_rows[w][k];
+    }
+private:
+    void set_rows();
+    void free_blocks();
+};
+
+#endif // COUNTS_H
@@ -9,13 +9,31 @@
 #define PERMUTE_LAG 10
 #define TABLE_SAMPLING true
 #define NUM_SPLIT_MERGE_TRIAL 15
-#define SPLIT_MERGE_MAX_ITER 1
+#define SPLIT_MERGE_MAX_ITER -1 // -1 means in every iteration
+#define CHECKPOINT_LAG 10 // iterations between the checkpoints, see hdp::resume()
+
+/// whether a split-merge move shares a topic with any of moves
+static bool shares_topic(const sm_move & move, const vector <sm_move> & moves)
+{
+    for (unsigned int j = 0; j < moves.size(); j++)
+    {
+        if (move.k0 == moves[j].k0 || move.k0 == moves[j].k1) return true;
+        if (move.action == MERGE && (move.k1 == moves[j].k0 || move.k1 == moves[j].k1)) return true;
+    }
+    return false;
+}
 
 hdp::hdp()
 {
     //ctor
     m_hdp_param = NULL;
     m_state = NULL;
+
+    m_run.iteration = 0;
+    m_run.num_moves = 0;
+    m_run.num_accepted = 0;
+    m_run.seed = 0;
+    m_run.best_likelihood = 0.0;
 }
 
 hdp::~hdp()
@@ -32,10 +50,20 @@ void hdp::load(char * model_path)
     m_state->load_state_ex(model_path);
 }
 
+/// continue a run from its checkpoint, on the state set up from its corpus.
+/// the priors, the seed and the sampler are those of the run.
+void hdp::resume(char * checkpoint_path)
+{
+    m_state->load_checkpoint(checkpoint_path, m_hdp_param, &m_run);
+}
+
 void hdp::setup_state(const corpus * c,
                       hdp_hyperparameter * _hdp_param)
 {
     m_hdp_param = _hdp_param;
+    m_state->m_sampler = m_hdp_param->m_sampler;
+    m_state->m_num_threads = m_hdp_param->m_num_threads;
+    m_state->m_output_format = m_hdp_param->m_output_format;
     m_state->setup_state_from_corpus(c);
     m_state->allocate_initial_space();
 }
@@ -47,6 +75,9 @@ void hdp::setup_state(const corpus * c,
 
     m_hdp_param = _hdp_param;
     m_state = new hdp_state();
+    m_state->m_sampler = m_hdp_param->m_sampler;
+    m_state->m_num_threads = m_hdp_param->m_num_threads;
+    m_state->m_output_format = m_hdp_param->m_output_format;
 
     m_state->setup_state_from_corpus(c);
     m_state->allocate_initial_space();
@@ -59,7 +90,8 @@ void hdp::setup_state(const corpus * c,
     m_state->m_alpha = m_hdp_param->m_alpha_a * m_hdp_param->m_alpha_b;
 }
 
-void hdp::run(const char * directory)
+/// the first assignment of the words, as --init_topics asks
+void hdp::init_state()
 {
     if (m_state->m_num_topics == 0)
         m_state->iterate_gibbs_state(false, PERMUTE, m_hdp_param, TABLE_SAMPLING); //init the state
@@ -70,14 +102,41 @@ void hdp::run(const char * directory)
         m_state->m_num_topics = abs(m_state->m_num_topics);
         m_state->init_gibbs_state_with_fixed_num_topics();
     }
-    printf("starting with %d topics \n", m_state->m_num_topics);
-
-    double best_likelihood = m_state->joint_likelihood(m_hdp_param);
+}
 
+void hdp::run(const char * directory)
+{
     char name[500];
+    FILE* file = NULL;
+    FILE* phases = NULL;
+    double best_likelihood;
+    sprintf(name, "%s/phases.log", directory);
+    phases = fopen(name, m_run.iteration == 0 ? "w" : "a");
+    if (m_run.iteration == 0)
+        fprintf(phases, "iter word.time table.time compact.time hyper.time likelihood.time "
+                        "save.time split.merge.time tables.created tables.destroyed "
+                        "topics.born topics.died bytes.written\n");
+
     sprintf(name, "%s/state.log", directory);
-    FILE* file = fopen(name, "w");
-    fprintf(file, "time iter num.topics num.tables likelihood gamma alpha split merge trial\n");
+    if (m_run.iteration == 0)
+    {
+        init_state();
+        fprintf(m_state->m_log, "starting with %d topics \n", m_state->m_num_topics);
+
+        best_likelihood = m_state->joint_likelihood(m_hdp_param);
+
+        file = fopen(name, "w");
+        fprintf(file, "time iter num.topics num.tables likelihood gamma alpha split merge trial\n");
+    }
+    else
+    {
+        fprintf(m_state->m_log, "resuming at iteration %d with %d topics \n",
+                m_run.iteration, m_state->m_num_topics);
+        best_likelihood = m_run.best_likelihood;
+        file = fopen(name, "a");
+    }
+
+    if (m_hdp_param->m_burn_in >= 0) setup_average(directory);
 
     bool permute = false;
 
@@ -86,22 +145,30 @@ void hdp::run(const char * directory)
     time (&start);
     double dif;
     ///
-    int tot = 0;
-    int acc = 0;
-    for (int iter = 0; iter < m_hdp_param->m_max_iter; iter++)
+    int tot = m_run.num_moves;
+    int acc = m_run.num_accepted;
+    bool stopped = converged(); // a resumed run may have stopped already
+    for (int iter = m_run.iteration; iter < m_hdp_param->m_max_iter && !stopped; iter++)
     {
-        printf("iter = %05d, ", iter);
+        rstream(iter + 1); // iteration 0 is the initialization
+        fprintf(m_state->m_log, "iter = %05d, ", iter);
+
+        phase_stats & stats = m_state->m_stats;
+        stats.reset();
+        int num_topics = m_state->m_num_topics;
 
         if (PERMUTE && (iter > 0) && (iter % PERMUTE_LAG == 0)) permute = true;
         else permute = false;
 
         m_state->iterate_gibbs_state(true, permute, m_hdp_param, TABLE_SAMPLING);
 
+        double phase_start = wall_time();
         double likelihood = m_state->joint_likelihood(m_hdp_param);
+        stats.likelihood_time = wall_time() - phase_start;
 
         time(&current); dif = difftime (current,start);
 
-        printf("#topics = %04d, #tables = %04d, gamma = %.5f, alpha = %.5f, likelihood = %.5f\n",
+        fprintf(m_state->m_log, "#topics = %04d, #tables = %04d, gamma = %.5f, alpha = %.5f, likelihood = %.5f\n",
                         m_state->m_num_topics, m_state->m_total_num_tables,
                         m_state->m_gamma, m_state->m_alpha, likelihood);
 
@@ -109,6 +176,7 @@ void hdp::run(const char * directory)
                 dif, iter, m_state->m_num_topics, m_state->m_total_num_tables,
                 likelihood, m_state->m_gamma, m_state->m_alpha);
 
+        phase_start = wall_time();
         if (best_likelihood < likelihood)
         {
             best_likelihood = likelihood;
@@ -125,92 +193,212 @@ void hdp::run(const char * directory)
             sprintf(name, "%s/%05d.bin", directory, iter);
             m_state->save_state_ex(name);
         }
+        stats.save_time = wall_time() - phase_start;
 
+        phase_start = wall_time();
         int num_split=0, num_merge=0, num_trial = 0;
         //if (m_hdp_param->m_split_merge_sampler && iter < m_hdp_param->m_max_iter-1)
-        if (m_hdp_param->m_split_merge_sampler && iter < SPLIT_MERGE_MAX_ITER)
+        if (m_hdp_param->m_split_merge_sampler &&
+            (SPLIT_MERGE_MAX_ITER < 0 || iter < SPLIT_MERGE_MAX_ITER))
         {
             num_trial = NUM_SPLIT_MERGE_TRIAL;
-            for (int num = 0; num < num_trial; num++)
+            int num_scans = m_hdp_param->m_num_restricted_scans;
+            int batch_size = m_hdp_param->m_num_threads;
+            vector <sm_move> moves;
+            sm_move move;
+            bool deferred = false;
+            for (int num = 0; num < num_trial; num += moves.size())
             {
-                tot ++;
-                hdp_state* proposed_state = new hdp_state();
-                proposed_state->copy_state(m_state);
-
-                int num_scans = m_hdp_param->m_num_restricted_scans;
-                int d0, t0, d1, t1;
-                ACTION action = m_state->select_mcmc_move(d0, d1, t0, t1);
-                if (action == SPLIT)
+                /// with more threads, a batch of moves on different topics is
+                /// evaluated at once. a move sharing a topic with the batch
+                /// waits for the next one, and is seeded again then.
+                moves.clear();
+                while (num + (int)moves.size() < num_trial && (int)moves.size() < batch_size)
                 {
-                    int k0 = m_state->m_doc_states[d0]->m_table_to_topic[t0];
-                    int k1 = m_state->m_num_topics;
-                    double prob_split = proposed_state->split_sampling(num_scans, d0, d1, t0, t1);
-
-                    double r = compute_split_ratio(proposed_state, m_state, k0, k1);
-                    printf("like.log = %5.2lf, ", r);
-                    printf("scan.log = %5.2lf, ", prob_split);
-                    r -= prob_split;
+                    if (!deferred) m_state->select_mcmc_move(move.d0, move.d1, move.t0, move.t1);
+                    m_state->seed_move(move);
+                    deferred = shares_topic(move, moves);
+                    if (deferred) break;
+                    moves.push_back(move);
+                }
+                m_state->evaluate_moves(moves, num_scans);
 
-                    double u = log(runiform());
-                    if (u < r)
+                for (unsigned int j = 0; j < moves.size(); j++)
+                {
+                    tot ++;
+                    fprintf(m_state->m_log, "like.log = %5.2lf, ", moves[j].likelihood_ratio);
+                    fprintf(m_state->m_log, "scan.log = %5.2lf, ", moves[j].scan_prob);
+                    if (moves[j].action == SPLIT)
                     {
-                        acc ++;
-                        num_split++;
-                        printf("ratio.log = %5.2lf/%5.2lf, split (--- A ---), ", r, u);
-                        printf("%d -> %d\n", m_state->m_num_topics, m_state->m_num_topics+1);
-                        hdp_state* old_state = m_state;
-                        m_state = proposed_state;
-                        proposed_state = old_state;
+                        double r = moves[j].likelihood_ratio - moves[j].scan_prob;
+                        double u = log(runiform());
+                        if (u < r)
+                        {
+                            acc ++;
+                            num_split++;
+                            fprintf(m_state->m_log, "ratio.log = %5.2lf/%5.2lf, split (--- A ---), ", r, u);
+                            fprintf(m_state->m_log, "%d -> %d\n", m_state->m_num_topics, m_state->m_num_topics+1);
+                            m_state->commit_proposal(moves[j]);
+                        }
+                        else
+                        {
+                            fprintf(m_state->m_log, "ratio.log = %5.2lf, split (--- R ---)\n", r);
+                        }
                     }
-                    else
+                    else // action == MERGE
                     {
-                        printf("ratio.log = %5.2lf, split (--- R ---)\n", r);
+                        double r = moves[j].likelihood_ratio + moves[j].scan_prob;
+                        double u = log(runiform());
+                        if (u < r)
+                        {
+                            acc++;
+                            num_merge++;
+                            fprintf(m_state->m_log, "ratio.log = %5.2lf/%5.2lf, merge (--- A ---), ", r, u);
+                            fprintf(m_state->m_log, "%d -> %d\n", m_state->m_num_topics, m_state->m_num_topics-1);
+                            m_state->commit_proposal(moves[j]);
+                        }
+                        else
+                        {
+                             fprintf(m_state->m_log, "ratio.log = %5.2lf, merge (--- R ---)\n", r);
+                        }
                     }
                 }
-                else // action == MERGE
-                {
-                    hdp_state* intermediat_state = new hdp_state();
-                    intermediat_state->copy_state(m_state);
+            }
+        }
 
-                    double prob_split = intermediat_state->split_sampling(num_scans, d0, d1, t0, t1, m_state);
+        stats.split_merge_time = wall_time() - phase_start;
 
-                    int k0 = m_state->m_doc_states[d0]->m_table_to_topic[t0];
-                    int k1 = m_state->m_doc_states[d1]->m_table_to_topic[t1];
-                    proposed_state->merge_two_topics(k0, k1);
+        if (m_state->m_average != NULL && iter >= m_hdp_param->m_burn_in)
+            m_state->accumulate_average();
 
-                    double r = -compute_split_ratio(m_state, proposed_state, k0, k1);
-                    printf("like.log = %5.2lf, ", r);
-                    printf("scan.log = %5.2lf, ", prob_split);
-                    r += prob_split;
+       fprintf(file, "%d %d %d\n", num_split, num_merge, num_trial);
 
-                    double u = log(runiform());
-                    if (u < r)
-                    {
-                        acc++;
-                        num_merge++;
-                        printf("ratio.log = %5.2lf/%5.2lf, merge (--- A ---), ", r, u);
-                        printf("%d -> %d\n", m_state->m_num_topics, m_state->m_num_topics-1);
-                        hdp_state* old_state = m_state;
-                        m_state = proposed_state;
-                        proposed_state = old_state;
-                    }
-                    else
-                    {
-                         printf("ratio.log = %5.2lf, merge (--- R ---)\n", r);
-                    }
-                    delete intermediat_state;
-                }
-                delete proposed_state;
-            }
+        m_run.iteration = iter + 1;
+        m_run.num_moves = tot;
+        m_run.num_accepted = acc;
+        m_run.best_likelihood = best_likelihood;
+        m_run.likelihoods.push_back(likelihood);
+        m_run.num_topics.push_back(m_state->m_num_topics);
+        stopped = converged();
+        if (m_run.iteration % CHECKPOINT_LAG == 0 || m_run.iteration == m_hdp_param->m_max_iter ||
+            stopped)
+        {
+            phase_start = wall_time();
+            fflush(file);
+            /// the sums go to average.next.bin, and replace average.bin
+            /// once the checkpoint is written; a run stopped in between
+            /// keeps the sums of either checkpoint, see setup_average()
+            bool average = m_state->m_average != NULL && m_state->m_average->num_samples > 0;
+            sprintf(name, "%s/average.next.bin", directory);
+            if (average) m_state->save_average(name, m_run.iteration);
+            sprintf(name, "%s/checkpoint.bin", directory);
+            m_state->save_checkpoint(name, m_hdp_param, &m_run);
+            if (average) replace_average(directory);
+            stats.save_time += wall_time() - phase_start;
         }
 
-       fprintf(file, "%d %d %d\n", num_split, num_merge, num_trial);
+        /// a topic dies in a compaction or a merge, the rest are born
+        int topics_died = num_topics + stats.topics_born - m_state->m_num_topics;
+        fprintf(phases, "%05d %.6f %.6f %.6f %.6f %.6f %.6f %.6f %ld %ld %ld %d %ld\n",
+                iter, stats.word_time, stats.table_time, stats.compact_time,
+                stats.hyper_time, stats.likelihood_time, stats.save_time,
+                stats.split_merge_time, stats.tables_created, stats.tables_destroyed,
+                stats.topics_born, topics_died, stats.bytes_written);
+        if (m_run.iteration % CHECKPOINT_LAG == 0) fflush(phases);
     }
+
+    const char * reason = "max_iter reached";
+    if (stopped && m_hdp_param->m_stop_rule == STOP_LIKELIHOOD)
+        reason = "the likelihood settled";
+    else if (stopped)
+        reason = "the number of topics settled";
+    fprintf(m_state->m_log, "stopped after %d iterations, %s\n", m_run.iteration, reason);
+    fprintf(file, "# stopped after %d iterations, %s\n", m_run.iteration, reason);
     fclose(file);
+    fclose(phases);
 
     if (m_hdp_param->m_split_merge_sampler)
-        printf("accepte rate: %.2lf\%\n", 100.0 * (double)acc/tot);
+        fprintf(m_state->m_log, "accepte rate: %.2lf\%\n", 100.0 * (double)acc/tot);
+
+}
+
+/// average.next.bin becomes average.bin, the sums of the checkpoint
+void hdp::replace_average(const char * directory)
+{
+    char next[500], name[500];
+    sprintf(next, "%s/average.next.bin", directory);
+    sprintf(name, "%s/average.bin", directory);
+    if (rename(next, name) != 0)
+    {
+        printf("can't write %s.\n", name);
+        exit(1);
+    }
+}
+
+/// the sums of the posterior averages, or, for a run resumed after its
+/// burn-in, those saved with its checkpoint: average.next.bin if the run
+/// stopped before it replaced average.bin, otherwise average.bin
+void hdp::setup_average(const char * directory)
+{
+    m_state->setup_average(m_hdp_param->m_burn_in);
+    if (m_run.iteration <= m_hdp_param->m_burn_in) return;
 
+    char name[500];
+    posterior_average * average = m_state->m_average;
+    sprintf(name, "%s/average.next.bin", directory);
+    if (average->read(name) && average->iteration == m_run.iteration)
+        replace_average(directory);
+    else
+    {
+        sprintf(name, "%s/average.bin", directory);
+        if (!average->read(name)) average->iteration = -1;
+    }
+    if (average->iteration != m_run.iteration ||
+        average->burn_in != m_hdp_param->m_burn_in ||
+        average->num_docs() != m_state->m_num_docs ||
+        (int)average->topic_of_z.size() != m_state->m_num_topics)
+    {
+        printf("%s/average.bin doesn't match the checkpoint, resume with the same burn_in.\n", directory);
+        exit(1);
+    }
+}
+
+/// whether the run can stop after the iterations so far. with STOP_LIKELIHOOD,
+/// when the least-squares slope of the likelihood over the last m_stop_window
+/// iterations is at most m_stop_tol of its mean, per iteration; with
+/// STOP_TOPICS, when the number of topics over them varies by m_stop_tol at
+/// most. the history is kept in the checkpoints, so a resumed run stops
+/// where the uninterrupted one would have.
+bool hdp::converged() const
+{
+    int n = m_run.likelihoods.size();
+    int window = m_hdp_param->m_stop_window;
+    if (m_hdp_param->m_stop_rule == STOP_NONE || m_run.iteration < m_hdp_param->m_min_iter ||
+        n < window)
+        return false;
+
+    if (m_hdp_param->m_stop_rule == STOP_TOPICS)
+    {
+        int min_topics = m_run.num_topics[n - window], max_topics = min_topics;
+        for (int j = n - window + 1; j < n; j++)
+        {
+            min_topics = min(min_topics, (int)m_run.num_topics[j]);
+            max_topics = max(max_topics, (int)m_run.num_topics[j]);
+        }
+        return max_topics - min_topics <= m_hdp_param->m_stop_tol;
+    }
+
+    const double * y = &m_run.likelihoods[n - window];
+    double mean_x = 0.5 * (window - 1), mean_y = 0.0;
+    for (int j = 0; j < window; j++) mean_y += y[j];
+    mean_y /= window;
+    double sxy = 0.0, sxx = 0.0;
+    for (int j = 0; j < window; j++)
+    {
+        sxy += (j - mean_x) * (y[j] - mean_y);
+        sxx += (j - mean_x) * (j - mean_x);
+    }
+    return sxy / sxx <= m_hdp_param->m_stop_tol * fabs(mean_y);
 }
 
 void hdp::run_test(const char * directory)
@@ -232,6 +420,7 @@ void hdp::run_test(const char * directory)
     double likelihood, best_likelihood;
     for (int iter = 0; iter < m_hdp_param->m_max_iter; iter++)
     {
+        rstream(iter + 1); // iteration 0 is the initialization
         printf("iter = %05d, ", iter);
 
         if (PERMUTE && (iter > 0) && (iter % PERMUTE_LAG == 0)) permute = true;
@@ -14,11 +14,18 @@ public:
 /// sampling state
     hdp_state * m_state;
 
+/// where the run is, saved in the checkpoints
+    run_state m_run;
+
 public:
     hdp();
     virtual ~hdp();
 public:
+    void init_state();
     void run(const char * directory);
+    bool converged() const;
+    void setup_average(const char * directory);
+    void replace_average(const char * directory);
     void run_test(const char * directory);
 
     void setup_state(const corpus * c,
@@ -27,6 +34,7 @@ public:
     void setup_state(const corpus * c, 
                      hdp_hyperparameter * _hdp_param);
     void load(char * model_path);
+    void resume(char * checkpoint_path);
 
 };
 
@@ -0,0 +1,20 @@
+// convert a corpus in lda-c format to the binary format (see corpus.h),
+// which hdp maps instead of parsing.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include "corpus.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        printf("usage: %s <lda-c data> <binary data>\n", argv[0]);
+        exit(0);
+    }
+    corpus * c = new corpus();
+    c->read_data(argv[1]);
+    c->write_binary(argv[2]);
+    delete c;
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "lgamma_cache.h"
+
+#define LGAMMA_CACHE_INIT 256
+#define LGAMMA_CACHE_MAX  (1 << 20)
+
+lgamma_cache::lgamma_cache()
+{
+    m_a = 0.0;
+    m_table = NULL;
+    m_size = 0;
+    m_shared = false;
+}
+
+void lgamma_cache::reset(double a)
+{
+    m_a = a;
+    m_values.clear();
+    m_table = NULL;
+    m_size = 0;
+    m_shared = false;
+    grow(LGAMMA_CACHE_INIT - 1);
+}
+
+double lgamma_cache::grow(int n)
+{
+    if (m_shared || n >= LGAMMA_CACHE_MAX) return lgamma(m_a + n);
+
+    int size = m_values.size();
+    int new_size = 2 * size > n + 1 ? 2 * size : n + 1;
+    if (new_size > LGAMMA_CACHE_MAX) new_size = LGAMMA_CACHE_MAX;
+    m_values.resize(new_size);
+    for (int i = size; i < new_size; i++)
+        m_values[i] = lgamma(m_a + i);
+    m_table = &m_values[0];
+    m_size = new_size;
+    return m_values[n];
+}
+
+/// read the table of other, grown first to hold n, instead of an own one.
+/// other must not change while it is shared; n past the table get lgamma.
+void lgamma_cache::share(lgamma_cache & other, int n)
+{
+    if (n >= LGAMMA_CACHE_MAX) n = LGAMMA_CACHE_MAX - 1;
+    if (n >= other.m_size) other.grow(n);
+    vector<double>().swap(m_values);
+    m_a = other.m_a;
+    m_table = other.m_table;
+    m_size = other.m_size;
+    m_shared = true;
+}
+
+/// out[i] += lgamma(a + n[i] + c) - lgamma(a + n[i]), for a row of counts.
+/// the table is grown for the largest count first, so the loop is only
+/// loads and adds, which the compiler can vectorise.
+void lgamma_cache::add_diff(const int* n, int num, int c, double* out)
+{
+    int i, max_n = 0;
+    for (i = 0; i < num; i++)
+        if (n[i] > max_n) max_n = n[i];
+    if (c > 0) max_n += c;
+
+    if (max_n >= m_size) grow(max_n);
+    if (max_n >= m_size)
+    {
+        for (i = 0; i < num; i++) out[i] += diff(n[i], c);
+        return;
+    }
+
+    const double* values = m_table;
+    for (i = 0; i < num; i++)
+        out[i] += values[n[i] + c] - values[n[i]];
+}
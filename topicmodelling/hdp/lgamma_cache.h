@@ -0,0 +1,49 @@
+#ifndef LGAMMA_CACHE_H
+#define LGAMMA_CACHE_H
+
+#include <math.h>
+#include <vector>
+using namespace std;
+
+/// lgamma(a + n) for a fixed a and integers n >= 0, kept in a dense table
+/// that grows as larger n are asked for, up to LGAMMA_CACHE_MAX entries;
+/// lgamma is called for n beyond that. the samplers only need a = eta and
+/// a = V*eta with count offsets, so a lookup replaces most lgamma calls.
+///
+/// a cache can also read the table of another (see share()), as the workers
+/// of a parallel sweep do; it then never grows the table itself.
+class lgamma_cache
+{
+public:
+    lgamma_cache();
+public:
+    /// drop the table when a changes
+    void set(double a)
+    {
+        if (a != m_a || m_size == 0) reset(a);
+    }
+    double operator()(int n)
+    {
+        return n < m_size ? m_table[n] : grow(n);
+    }
+    /// lgamma(a + n + c) - lgamma(a + n)
+    double diff(int n, int c)
+    {
+        return (*this)(n + c) - (*this)(n);
+    }
+    void add_diff(const int* n, int num, int c, double* out);
+    void share(lgamma_cache & other, int n);
+private:
+    lgamma_cache(const lgamma_cache &);
+    lgamma_cache & operator=(const lgamma_cache &);
+    void   reset(double a);
+    double grow(int n);
+private:
+    double m_a;
+    vector<double> m_values;
+    const double*  m_table;  // m_values, or the table of the cache shared
+    int            m_size;
+    bool           m_shared;
+};
+
+#endif // LGAMMA_CACHE_H
@@ -2,9 +2,11 @@
 #include <string.h>
 #include "utils.h"
 #include "hdp.h"
+#include "batch.h"
+#include "server.h"
 #define VERBOSE true
 
-gsl_rng * RANDOM_NUMBER;
+__thread gsl_rng * RANDOM_NUMBER; // each thread of a parallel sweep sets its own
 
 void print_usage_and_exit()
 {
@@ -13,10 +15,11 @@ void print_usage_and_exit()
     printf("usage:\n");
     printf("      hdp [options]\n");
     printf("      general parameters:\n");
-    printf("      --algorithm:      train or test, not optional\n");
+    printf("      --algorithm:      train, test or serve, not optional\n");
     printf("      --data:           data file, in lda-c format, not optional\n");
     printf("      --directory:      save directory, not optional\n");
     printf("      --max_iter:       the max number of iterations, default 1000\n");
+    printf("      --min_iter:       the min number of iterations before the stopping rule applies, default 0\n");
     printf("      --save_lag:       the saving lag, default 100 (-1 means no savings for intermediate results)\n");
     printf("      --random_seed:    the random seed, default from the current time\n");
     printf("      --init_topics:    the initial number of topics, default 0\n");
@@ -30,13 +33,34 @@ void print_usage_and_exit()
     printf("      --eta:            topic Dirichlet parameter, default 0.5\n");
     printf("      --split_merge:    try split-merge or not, yes or no, default \"no\"\n");
     printf("      --restrict_scan:  number of intermediate scans, default 5 (-1 means no scan)\n");
+    printf("      --sampler:        word sampler, dense, sparse or alias, default \"dense\"\n");
+    printf("      --threads:        number of threads sampling the documents and the split-merge moves, default 1\n");
+    printf("      --output_format:  format of the saved counts, text or bin, default \"text\"\n");
+    printf("      --resume:         continue from checkpoint.bin in the directory if there is one, yes or no, default \"no\"\n");
+    printf("      --burn_in:        iterations before the topic-word and doc-topic distributions are averaged\n");
+    printf("                        into average.bin, default -1 (no averages)\n");
+    printf("      --stop_rule:      stop before max_iter when the likelihood or the number of topics settles,\n");
+    printf("                        none, likelihood or topics, default \"none\"\n");
+    printf("      --stop_window:    number of iterations the stopping rule looks at, default 20\n");
+    printf("      --stop_tol:       likelihood: the largest slope per iteration, relative to the likelihood, default 1e-5;\n");
+    printf("                        topics: the largest change in the number of topics, default 2\n");
+
+    printf("\n      batch parameters:\n");
+    printf("      --batch:          manifest of models to train, one \"data directory [random_seed]\" per line,\n");
+    printf("                        in place of algorithm, data and directory; --threads models are trained at once\n");
 
     printf("\n      testing parameters:\n");
     printf("      --saved_model:    path for saved model, not optional\n");
 
+    printf("\n      serving parameters:\n");
+    printf("      --saved_model:    path for a saved model, repeated for each model to serve\n");
+    printf("      --socket:         unix socket to serve on, default stdin and stdout\n");
+
     printf("\nexamples:\n");
     printf("      ./hdp --algorithm train --data data --directory train_dir\n");
     printf("      ./hdp --algorithm test --data data --saved_model saved_model --directory test_dir\n");
+    printf("      ./hdp --batch manifest --threads 4\n");
+    printf("      ./hdp --algorithm serve --saved_model saved_model --socket /tmp/hdp.sock\n");
     printf("\n");
     exit(0);
 }
@@ -51,10 +75,17 @@ int main(int argc, char** argv)
 
     double gamma_a = 1.0, gamma_b = 1.0, alpha_a = 1.0, alpha_b = 1.0, eta = 0.5;
     int max_iter = 1000, save_lag = 100, init_topics = 0;
+    int min_iter = 0, stop_rule = STOP_NONE, stop_window = 20;
+    double stop_tol = -1.0;
+    int burn_in = -1;
     bool sample_hyperparameter = false;
 
     bool split_merge = false;
     int num_restricted_scan = 5;
+    int sampler = DENSE_SAMPLER;
+    int num_threads = 1;
+    int output_format = TEXT_OUTPUT;
+    bool resume = false;
 
     time_t t;
     time(&t);
@@ -64,12 +95,19 @@ int main(int argc, char** argv)
     char* algorithm = NULL;;
     char* data_path = NULL;
     char* model_path = NULL;
+    char* manifest_path = NULL;
+    char* socket_path = NULL;
+    vector <char*> model_paths;
 
     for (int i = 1; i < argc; i++)
     {
         if (!strcmp(argv[i], "--algorithm"))        algorithm = argv[++i];
         else if (!strcmp(argv[i], "--data"))        data_path = argv[++i];
         else if (!strcmp(argv[i], "--max_iter"))    max_iter = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--min_iter"))    min_iter = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stop_window")) stop_window = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stop_tol"))    stop_tol = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--burn_in"))     burn_in = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--save_lag"))    save_lag = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--init_topics")) init_topics = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--directory"))   directory = argv[++i];
@@ -80,13 +118,48 @@ int main(int argc, char** argv)
         else if (!strcmp(argv[i], "--alpha_b"))     alpha_b = atof(argv[++i]);
         else if (!strcmp(argv[i], "--eta"))         eta = atof(argv[++i]);
         else if (!strcmp(argv[i], "--restrict_scan")) num_restricted_scan = atoi(argv[++i]);
-        else if (!strcmp(argv[i], "--saved_model")) model_path = argv[++i];
+        else if (!strcmp(argv[i], "--saved_model"))
+        {
+            model_path = argv[++i];
+            model_paths.push_back(model_path);
+        }
+        else if (!strcmp(argv[i], "--socket"))      socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--threads"))     num_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--batch"))       manifest_path = argv[++i];
         else if (!strcmp(argv[i], "--split_merge"))
         {
            ++i;
             if (!strcmp(argv[i], "yes") ||  !strcmp(argv[i], "YES"))
                 split_merge = true;
         }
+        else if (!strcmp(argv[i], "--sampler"))
+        {
+           ++i;
+            if (!strcmp(argv[i], "sparse") ||  !strcmp(argv[i], "SPARSE"))
+                sampler = SPARSE_SAMPLER;
+            else if (!strcmp(argv[i], "alias") ||  !strcmp(argv[i], "ALIAS"))
+                sampler = ALIAS_SAMPLER;
+        }
+        else if (!strcmp(argv[i], "--output_format"))
+        {
+           ++i;
+            if (!strcmp(argv[i], "bin") ||  !strcmp(argv[i], "BIN"))
+                output_format = BINARY_OUTPUT;
+        }
+        else if (!strcmp(argv[i], "--resume"))
+        {
+           ++i;
+            if (!strcmp(argv[i], "yes") ||  !strcmp(argv[i], "YES"))
+                resume = true;
+        }
+        else if (!strcmp(argv[i], "--stop_rule"))
+        {
+           ++i;
+            if (!strcmp(argv[i], "likelihood") ||  !strcmp(argv[i], "LIKELIHOOD"))
+                stop_rule = STOP_LIKELIHOOD;
+            else if (!strcmp(argv[i], "topics") ||  !strcmp(argv[i], "TOPICS"))
+                stop_rule = STOP_TOPICS;
+        }
         else if (!strcmp(argv[i], "--sample_hyper"))
         {
            ++i;
@@ -100,6 +173,65 @@ int main(int argc, char** argv)
         }
     }
 
+    if (stop_window < 2)
+    {
+        printf("stop_window must be at least 2.\n");
+        exit(0);
+    }
+    if (stop_tol < 0.0) stop_tol = (stop_rule == STOP_TOPICS) ? 2.0 : 1e-5;
+
+    if (manifest_path != NULL)
+    {
+        vector <batch_job> jobs;
+        read_manifest(manifest_path, seed, jobs);
+        printf("training %d models, %d at a time\n", (int)jobs.size(), num_threads);
+
+        hdp_hyperparameter * hdp_hyperparam = new hdp_hyperparameter();
+        hdp_hyperparam->setup_parameters(gamma_a, gamma_b,
+                                         alpha_a, alpha_b,
+                                         max_iter, save_lag,
+                                         num_restricted_scan,
+                                         sample_hyperparameter,
+                                         split_merge, sampler, 1,
+                                         output_format);
+        hdp_hyperparam->setup_stopping_rule(stop_rule, min_iter, stop_window, stop_tol);
+        hdp_hyperparam->setup_average(burn_in);
+
+        run_batch(jobs, hdp_hyperparam, eta, init_topics, num_threads, resume);
+
+        delete hdp_hyperparam;
+        return 0;
+    }
+
+    if (algorithm != NULL && !strcmp(algorithm, "serve"))
+    {
+        if (model_paths.empty())
+        {
+            printf("Note that saved_model is not optional!\n");
+            exit(0);
+        }
+        vector <resident_model*> models;
+        for (unsigned int m = 0; m < model_paths.size(); m++)
+        {
+            models.push_back(new resident_model());
+            models[m]->load(model_paths[m]);
+        }
+
+        if (socket_path != NULL)
+            serve_socket(socket_path, models, seed);
+        else
+        {
+            RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_philox);
+            gsl_rng_set(RANDOM_NUMBER, (long) seed);
+            serve_stream(stdin, stdout, models);
+            gsl_rng_free(RANDOM_NUMBER);
+        }
+
+        for (unsigned int m = 0; m < models.size(); m++)
+            delete models[m];
+        return 0;
+    }
+
     if (algorithm == NULL || directory == NULL || data_path == NULL)
     {
         printf("Note that algorithm, directory and data are not optional!\n");
@@ -134,13 +266,41 @@ int main(int argc, char** argv)
         printf("sampling hyperparam = yes\n");
         else
         printf("sampling hyperparam = no\n");
+        if (sampler == SPARSE_SAMPLER)
+        printf("sampler             = sparse\n");
+        else if (sampler == ALIAS_SAMPLER)
+        printf("sampler             = alias\n");
+        else
+        printf("sampler             = dense\n");
+        printf("threads             = %d\n", num_threads);
+        if (output_format == BINARY_OUTPUT)
+        printf("output format       = bin\n");
+        else
+        printf("output format       = text\n");
+        if (resume)
+        printf("resume              = yes\n");
+        else
+        printf("resume              = no\n");
+        if (stop_rule == STOP_LIKELIHOOD)
+        printf("stop rule           = likelihood\n");
+        else if (stop_rule == STOP_TOPICS)
+        printf("stop rule           = topics\n");
+        else
+        printf("stop rule           = none\n");
+        printf("burn_in             = %d\n", burn_in);
+        if (stop_rule != STOP_NONE)
+        {
+        printf("min_iter            = %d\n", min_iter);
+        printf("stop_window         = %d\n", stop_window);
+        printf("stop_tol            = %g\n", stop_tol);
+        }
     }
 
     if (!dir_exists(directory))
         mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR);
 
     // allocate the random number structure
-    RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_taus);
+    RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_philox);
     gsl_rng_set(RANDOM_NUMBER, (long) seed); // init the seed
 
     if (!strcmp(algorithm, "train"))
@@ -157,12 +317,24 @@ int main(int argc, char** argv)
                                          max_iter, save_lag,
                                          num_restricted_scan,
                                          sample_hyperparameter,
-                                         split_merge);
+                                         split_merge, sampler, num_threads,
+                                         output_format);
+        hdp_hyperparam->setup_stopping_rule(stop_rule, min_iter, stop_window, stop_tol);
+        hdp_hyperparam->setup_average(burn_in);
 
         hdp * hdp_instance = new hdp();
 
         hdp_instance->setup_state(c, eta, init_topics,
                                   hdp_hyperparam);
+        hdp_instance->m_run.seed = seed;
+
+        char checkpoint_path[500];
+        sprintf(checkpoint_path, "%s/checkpoint.bin", directory);
+        if (resume && file_exists(checkpoint_path))
+        {
+            hdp_instance->resume(checkpoint_path);
+            gsl_rng_set(RANDOM_NUMBER, hdp_instance->m_run.seed);
+        }
 
         hdp_instance->run(directory);
 
@@ -183,7 +355,8 @@ int main(int argc, char** argv)
                                          max_iter, save_lag,
                                          num_restricted_scan,
                                          sample_hyperparameter,
-                                         split_merge);
+                                         split_merge, sampler, num_threads,
+                                         output_format);
 
         hdp * hdp_instance = new hdp();
         hdp_instance->load(model_path);
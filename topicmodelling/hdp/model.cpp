@@ -0,0 +1,188 @@
+// reading and writing model and checkpoint files
+//
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "model.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static uint64_t fnv1a(const void * data, size_t size, uint64_t hash)
+{
+    const unsigned char * p = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static int64_t round_up(int64_t offset, int64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+model_file::model_file()
+{
+    header = NULL;
+    m_map = NULL;
+    m_map_size = 0;
+    unmap();
+}
+
+model_file::~model_file()
+{
+    unmap();
+}
+
+void model_file::unmap()
+{
+    if (m_map != NULL) munmap(m_map, m_map_size);
+    m_map = NULL;
+    m_map_size = 0;
+    header = NULL;
+    tables_by_z = words_by_z = word_counts = NULL;
+    doc_ids = table_topics = tokens = NULL;
+    table_offsets = token_offsets = NULL;
+    history_likelihoods = NULL;
+    history_topics = NULL;
+}
+
+bool model_file::map(const char * filename)
+{
+    unmap();
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0) return false;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(model_header))
+    {
+        close(fd);
+        return false;
+    }
+    m_map_size = st.st_size;
+    m_map = mmap(NULL, m_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = NULL;
+        return false;
+    }
+
+    const char * base = (const char *)m_map;
+    const model_header * h = (const model_header *)m_map;
+    if (memcmp(h->magic, MODEL_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != MODEL_VERSION || h->byte_order != MODEL_BYTE_ORDER ||
+        h->size_vocab < 0 || h->num_topics < 0 || h->num_docs < 0 ||
+        h->total_num_tables < 0 || h->total_words < 0 || h->num_history < 0)
+    {
+        unmap();
+        return false;
+    }
+
+    /// the sections must be where the sizes put them, and end the file
+    int64_t num_topics = h->num_topics;
+    int64_t end = h->word_counts_offset + 4 * (int64_t)h->size_vocab * num_topics;
+    bool ok = h->topics_offset == (int64_t)sizeof(model_header) &&
+              h->word_counts_offset >= h->topics_offset + 8 * num_topics &&
+              h->word_counts_offset % MODEL_PAGE_SIZE == 0;
+    int64_t doc_ids_size = round_up(4 * (int64_t)h->num_docs, 8);
+    int64_t offsets_size = 8 * ((int64_t)h->num_docs + 1);
+    if (h->num_docs > 0)
+    {
+        ok = ok && h->docs_offset >= end && h->docs_offset % 8 == 0;
+        end = h->docs_offset + doc_ids_size + 2 * offsets_size +
+              round_up(4 * (int64_t)h->total_num_tables, 8) + 8 * h->total_words +
+              8 * (int64_t)h->num_history + round_up(4 * (int64_t)h->num_history, 8);
+    }
+    else
+        ok = ok && h->docs_offset == 0 && h->num_history == 0;
+    ok = ok && end == h->file_size && (size_t)end == m_map_size &&
+         fnv1a(base + sizeof(model_header), m_map_size - sizeof(model_header),
+               FNV_OFFSET) == h->checksum;
+    if (!ok)
+    {
+        unmap();
+        return false;
+    }
+
+    header = h;
+    tables_by_z = (const int *)(base + h->topics_offset);
+    words_by_z  = tables_by_z + num_topics;
+    word_counts = (const int *)(base + h->word_counts_offset);
+    if (h->num_docs > 0)
+    {
+        const char * p = base + h->docs_offset;
+        doc_ids       = (const int *)p;           p += doc_ids_size;
+        table_offsets = (const int64_t *)p;       p += offsets_size;
+        token_offsets = (const int64_t *)p;       p += offsets_size;
+        table_topics  = (const int *)p;           p += round_up(4 * (int64_t)h->total_num_tables, 8);
+        tokens        = (const int *)p;           p += 8 * h->total_words;
+        history_likelihoods = (const double *)p;  p += 8 * (int64_t)h->num_history;
+        history_topics      = (const int *)p;
+
+        ok = table_offsets[0] == 0 && token_offsets[0] == 0 &&
+             table_offsets[h->num_docs] == h->total_num_tables &&
+             token_offsets[h->num_docs] == h->total_words;
+        for (int j = 0; ok && j < h->num_docs; j++)
+            ok = table_offsets[j] <= table_offsets[j+1] && token_offsets[j] <= token_offsets[j+1];
+        if (!ok)
+        {
+            unmap();
+            return false;
+        }
+    }
+    return true;
+}
+
+void model_writer::open(const char * filename)
+{
+    m_file = fopen(filename, "wb");
+    if (m_file == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+    header.version = MODEL_VERSION;
+    header.byte_order = MODEL_BYTE_ORDER;
+    header.checksum = FNV_OFFSET;
+
+    fwrite(&header, sizeof(header), 1, m_file);
+    m_offset = sizeof(header);
+}
+
+void model_writer::write(const void * data, size_t size)
+{
+    if (size == 0) return;
+    fwrite(data, 1, size, m_file);
+    header.checksum = fnv1a(data, size, header.checksum);
+    m_offset += size;
+}
+
+void model_writer::align(int64_t alignment)
+{
+    static const char zeros[MODEL_PAGE_SIZE] = {0};
+    write(zeros, round_up(m_offset, alignment) - m_offset);
+}
+
+void model_writer::close()
+{
+    header.file_size = m_offset;
+    fseek(m_file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, m_file);
+    bool failed = ferror(m_file) != 0;
+    if (fclose(m_file) != 0 || failed)
+    {
+        printf("can't write a model file.\n");
+        exit(1);
+    }
+    m_file = NULL;
+}
+
+// end of the file
@@ -0,0 +1,141 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/// model and checkpoint files, save_state_ex() and save_checkpoint(), in the
+/// byte order of the machine that wrote them:
+///   header      : model_header below
+///   topics      : num_topics int32 tables, then num_topics int32 words
+///   word counts : size_vocab rows of num_topics int32, at word_counts_offset,
+///                 a multiple of MODEL_PAGE_SIZE, so the block can be mapped
+///                 read-only on its own
+/// a checkpoint has num_docs > 0 and, at docs_offset, the documents in the
+/// order the sampler visits them:
+///   doc ids      : num_docs int32, padded to 8 bytes
+///   table offsets: num_docs+1 int64, doc j owns tables [offsets[j], offsets[j+1])
+///   token offsets: num_docs+1 int64, doc j owns tokens [offsets[j], offsets[j+1])
+///   table topics : total_num_tables int32, padded to 8 bytes
+///   tokens       : total_words pairs of int32 word and int32 table
+///   history      : num_history double likelihoods, then num_history int32
+///                  numbers of topics, of the iterations so far, padded to
+///                  8 bytes, for the stopping rule
+/// the checksum is the 64 bit FNV-1a of every byte after the header.
+#define MODEL_MAGIC "HDPMODEL"
+#define MODEL_VERSION 1
+#define MODEL_BYTE_ORDER 0x01020304
+#define MODEL_PAGE_SIZE 4096
+
+struct model_header
+{
+    char    magic[8];
+    int32_t version;
+    int32_t byte_order;
+
+    int32_t size_vocab;
+    int32_t num_topics;
+    int32_t num_docs;
+    int32_t total_num_tables;
+    int64_t total_words;
+
+    /// the state of the sampler, and the priors of the run
+    double  eta;
+    double  gamma;
+    double  alpha;
+    double  gamma_a;
+    double  gamma_b;
+    double  alpha_a;
+    double  alpha_b;
+    int32_t sample_hyperparameter;
+    int32_t split_merge_sampler;
+    int32_t sampler;
+    int32_t num_restricted_scans;
+
+    /// where the run is, see run_state
+    int32_t iteration;
+    int32_t num_moves;
+    int32_t num_accepted;
+    int32_t num_history;
+    int64_t seed;
+    double  best_likelihood;
+
+    int64_t topics_offset;
+    int64_t word_counts_offset;
+    int64_t docs_offset;
+    int64_t file_size;
+    uint64_t checksum;
+};
+
+/// where a run is after an iteration: the next iteration, the split-merge
+/// moves tried and accepted so far, the seed of the random streams, the
+/// likelihood of the mode saved so far, and the likelihood and the number
+/// of topics after each iteration
+struct run_state
+{
+public:
+    int    iteration;
+    int    num_moves;
+    int    num_accepted;
+    long   seed;
+    double best_likelihood;
+    std::vector <double>  likelihoods;
+    std::vector <int32_t> num_topics;
+};
+
+/// a model or a checkpoint mapped read-only, with the sections found
+class model_file
+{
+public:
+    const model_header * header;
+    const int *     tables_by_z;
+    const int *     words_by_z;
+    const int *     word_counts;   // row w has the counts of word w in each topic
+    const int *     doc_ids;
+    const int64_t * table_offsets;
+    const int64_t * token_offsets;
+    const int *     table_topics;
+    const int *     tokens;        // word and table of each token
+    const double *  history_likelihoods; // the likelihood and the number of topics
+    const int *     history_topics;      // after each iteration of the run
+private:
+    void * m_map;
+    size_t m_map_size;
+public:
+    model_file();
+    ~model_file();
+    /// false if the file can't be mapped, isn't a model of MODEL_VERSION for
+    /// this byte order, or is damaged
+    bool map(const char * filename);
+    void unmap();
+    int count(int w, int k) const
+    {
+        return word_counts[(size_t)w * header->num_topics + k];
+    }
+};
+
+/// writes a model file section by section, keeping the checksum
+class model_writer
+{
+public:
+    model_header header;
+private:
+    FILE *   m_file;
+    int64_t  m_offset;
+public:
+    /// start the file after a blank header
+    void open(const char * filename);
+    void write(const void * data, size_t size);
+    /// pad with zeros to a multiple of alignment
+    void align(int64_t alignment);
+    int64_t offset() const
+    {
+        return m_offset;
+    }
+    /// write the header, with the file size and the checksum
+    void close();
+};
+
+#endif // MODEL_H
@@ -0,0 +1,190 @@
+// reading and writing the binary output of a saved state
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "output.h"
+
+static FILE* open_output(const char * filename)
+{
+    FILE * fileptr = fopen(filename, "wb");
+    if (fileptr == NULL)
+    {
+        printf("can't open %s.\n", filename);
+        exit(1);
+    }
+    return fileptr;
+}
+
+static void write_header(FILE * fileptr, const char * magic, int size_vocab,
+                         const vector<int64_t> & offsets)
+{
+    output_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = OUTPUT_VERSION;
+    header.num_rows = (int)offsets.size() - 1;
+    header.size_vocab = size_vocab;
+    header.num_entries = offsets.back();
+    fwrite(&header, sizeof(header), 1, fileptr);
+    fwrite(&offsets[0], sizeof(int64_t), offsets.size(), fileptr);
+}
+
+/// read the header and the offsets, false if the file isn't one of ours
+static bool read_header(FILE * fileptr, const char * magic, int * size_vocab,
+                        vector<int64_t> & offsets)
+{
+    output_header header;
+    if (fread(&header, sizeof(header), 1, fileptr) != 1 ||
+        memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+        header.version != OUTPUT_VERSION || header.num_rows < 0)
+        return false;
+
+    *size_vocab = header.size_vocab;
+    offsets.resize(header.num_rows + 1);
+    if (fread(&offsets[0], sizeof(int64_t), offsets.size(), fileptr) != offsets.size())
+        return false;
+    return offsets[0] == 0 && offsets.back() == header.num_entries;
+}
+
+template <typename T> static bool read_array(FILE * fileptr, vector<T> & v, int64_t n)
+{
+    v.resize(n);
+    return n == 0 || fread(&v[0], sizeof(T), n, fileptr) == (size_t)n;
+}
+
+template <typename T> static void write_array(FILE * fileptr, const vector<T> & v)
+{
+    if (!v.empty()) fwrite(&v[0], sizeof(T), v.size(), fileptr);
+}
+
+void topic_counts::write(const char * filename) const
+{
+    FILE * fileptr = open_output(filename);
+    write_header(fileptr, TOPICS_MAGIC, size_vocab, offsets);
+    write_array(fileptr, words);
+    write_array(fileptr, counts);
+    fclose(fileptr);
+}
+
+bool topic_counts::read(const char * filename)
+{
+    FILE * fileptr = fopen(filename, "rb");
+    if (fileptr == NULL) return false;
+    bool ok = read_header(fileptr, TOPICS_MAGIC, &size_vocab, offsets) &&
+              read_array(fileptr, words, offsets.back()) &&
+              read_array(fileptr, counts, offsets.back());
+    fclose(fileptr);
+    return ok;
+}
+
+void word_assignments::write(const char * filename) const
+{
+    FILE * fileptr = open_output(filename);
+    write_header(fileptr, ASSIGNMENTS_MAGIC, size_vocab, offsets);
+    write_array(fileptr, words);
+    write_array(fileptr, topics);
+    write_array(fileptr, tables);
+    fclose(fileptr);
+}
+
+bool word_assignments::read(const char * filename)
+{
+    FILE * fileptr = fopen(filename, "rb");
+    if (fileptr == NULL) return false;
+    bool ok = read_header(fileptr, ASSIGNMENTS_MAGIC, &size_vocab, offsets) &&
+              read_array(fileptr, words, offsets.back()) &&
+              read_array(fileptr, topics, offsets.back()) &&
+              read_array(fileptr, tables, offsets.back());
+    fclose(fileptr);
+    return ok;
+}
+
+/// the sparse rows flat, as the files keep them
+template <typename T> static void write_rows(FILE * fileptr, const vector< vector<int> > & keys,
+                                             const vector< vector<T> > & values)
+{
+    vector<int64_t> offsets(1, 0);
+    for (size_t j = 0; j < keys.size(); j++)
+        offsets.push_back(offsets.back() + keys[j].size());
+    fwrite(&offsets[0], sizeof(int64_t), offsets.size(), fileptr);
+    for (size_t j = 0; j < keys.size(); j++) write_array(fileptr, keys[j]);
+    for (size_t j = 0; j < values.size(); j++) write_array(fileptr, values[j]);
+}
+
+template <typename T> static bool read_rows(FILE * fileptr, int num_rows, int64_t num_entries,
+                                            vector< vector<int> > & keys,
+                                            vector< vector<T> > & values)
+{
+    vector<int64_t> offsets;
+    if (!read_array(fileptr, offsets, num_rows + 1) || offsets[0] != 0 ||
+        offsets.back() != num_entries)
+        return false;
+    keys.resize(num_rows);
+    values.resize(num_rows);
+    int j;
+    for (j = 0; j < num_rows; j++)
+        if (offsets[j+1] < offsets[j] || !read_array(fileptr, keys[j], offsets[j+1] - offsets[j]))
+            return false;
+    for (j = 0; j < num_rows; j++)
+        if (!read_array(fileptr, values[j], offsets[j+1] - offsets[j]))
+            return false;
+    return true;
+}
+
+void posterior_average::write(const char * filename) const
+{
+    average_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AVERAGE_MAGIC, sizeof(header.magic));
+    header.version = OUTPUT_VERSION;
+    header.num_samples = num_samples;
+    header.iteration = iteration;
+    header.burn_in = burn_in;
+    header.size_vocab = size_vocab;
+    header.num_topics = num_topics();
+    header.num_docs = num_docs();
+    header.num_state_topics = topic_of_z.size();
+    for (size_t k = 0; k < words.size(); k++) header.num_topic_entries += words[k].size();
+    for (size_t d = 0; d < doc_topics.size(); d++) header.num_doc_entries += doc_topics[d].size();
+
+    FILE * fileptr = open_output(filename);
+    fwrite(&header, sizeof(header), 1, fileptr);
+    write_array(fileptr, samples);
+    write_array(fileptr, weights);
+    write_array(fileptr, floors);
+    write_rows(fileptr, words, values);
+    write_array(fileptr, doc_smoothing);
+    write_rows(fileptr, doc_topics, doc_values);
+    write_array(fileptr, topic_of_z);
+    fclose(fileptr);
+}
+
+bool posterior_average::read(const char * filename)
+{
+    FILE * fileptr = fopen(filename, "rb");
+    if (fileptr == NULL) return false;
+    average_header header;
+    bool ok = fread(&header, sizeof(header), 1, fileptr) == 1 &&
+              memcmp(header.magic, AVERAGE_MAGIC, sizeof(header.magic)) == 0 &&
+              header.version == OUTPUT_VERSION && header.num_topics >= 0 &&
+              header.num_docs >= 0 && header.num_state_topics >= 0;
+    if (ok)
+    {
+        num_samples = header.num_samples;
+        iteration = header.iteration;
+        burn_in = header.burn_in;
+        size_vocab = header.size_vocab;
+        ok = read_array(fileptr, samples, header.num_topics) &&
+             read_array(fileptr, weights, header.num_topics) &&
+             read_array(fileptr, floors, header.num_topics) &&
+             read_rows(fileptr, header.num_topics, header.num_topic_entries, words, values) &&
+             read_array(fileptr, doc_smoothing, header.num_docs) &&
+             read_rows(fileptr, header.num_docs, header.num_doc_entries, doc_topics, doc_values) &&
+             read_array(fileptr, topic_of_z, header.num_state_topics);
+    }
+    fclose(fileptr);
+    return ok;
+}
+
+// end of the file
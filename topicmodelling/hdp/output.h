@@ -0,0 +1,127 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <vector>
+#include <stdint.h>
+using namespace std;
+
+/// binary output of a saved state, --output_format bin, in the byte order
+/// of the machine that wrote it. both files start with an output_header.
+///
+/// *-topics.bin, the nonzero word counts of each topic:
+///   offsets : num_rows+1 int64, topic k owns entries [offsets[k], offsets[k+1])
+///   words   : num_entries int32 word ids, increasing within a topic
+///   counts  : num_entries int32 counts
+///
+/// *-word-assignments.bin, the tokens of each document by doc id:
+///   offsets : num_rows+1 int64, doc d owns tokens [offsets[d], offsets[d+1])
+///   words   : num_entries int32 word ids
+///   topics  : num_entries int32 topics
+///   tables  : num_entries int32 tables
+///
+/// average.bin, the posterior averages of --burn_in, as sums over the
+/// num_samples iterations averaged; it starts with an average_header:
+///   topic samples : num_topics int32, the iterations each topic was in
+///   topic weights : num_topics double, sums of m_k/(m+gamma)
+///   topic floors  : num_topics double, sums of eta/(n_k+V*eta)
+///   topic offsets : num_topics+1 int64, topic k owns [offsets[k], offsets[k+1])
+///   topic words   : int32 word ids, increasing within a topic
+///   topic values  : double, sums of n_kw/(n_k+V*eta)
+///   doc smoothing : num_docs double, sums of alpha/(N_d+alpha)
+///   doc offsets   : num_docs+1 int64, doc d, by id, owns [offsets[d], offsets[d+1])
+///   doc topics    : int32 topics, increasing within a document
+///   doc values    : double, sums of n_dk/(N_d+alpha)
+///   state topics  : num_state_topics int32, the averaged topic of each topic
+///                   of the sampler, -1 for none, to resume the sums with
+/// a topic keeps its id when the sampler relabels it. divided by the samples
+/// of k, the average of (n_kw+eta)/(n_k+V*eta) over the iterations k was in
+/// is the value of w plus the floor of k. divided by num_samples, the
+/// average of (n_dk+alpha*m_k/(m+gamma))/(N_d+alpha) is the value of k plus
+/// the smoothing of d times the weight of k; the product of the averages
+/// stands for the average of the product when alpha is sampled.
+#define TOPICS_MAGIC "HDPTOPIC"
+#define ASSIGNMENTS_MAGIC "HDPASSGN"
+#define AVERAGE_MAGIC "HDPAVERG"
+#define OUTPUT_VERSION 1
+
+enum OUTPUT_FORMAT {TEXT_OUTPUT, BINARY_OUTPUT};
+
+struct output_header
+{
+    char    magic[8];
+    int32_t version;
+    int32_t num_rows;   // topics or documents
+    int32_t size_vocab;
+    int32_t reserved;
+    int64_t num_entries;
+};
+
+struct average_header
+{
+    char    magic[8];
+    int32_t version;
+    int32_t num_samples;
+    int32_t iteration;  // of the run, the sums are those after it
+    int32_t size_vocab;
+    int32_t num_topics;
+    int32_t num_docs;
+    int32_t num_state_topics;
+    int32_t burn_in;
+    int64_t num_topic_entries;
+    int64_t num_doc_entries;
+};
+
+/// the topic-word counts, one sparse row per topic
+class topic_counts
+{
+public:
+    bool read(const char * filename);
+    void write(const char * filename) const;
+    int num_topics() const { return (int)offsets.size() - 1; }
+public:
+    int size_vocab;
+    vector<int64_t> offsets;
+    vector<int> words;
+    vector<int> counts;
+};
+
+/// the word, topic and table of each token, grouped by document
+class word_assignments
+{
+public:
+    bool read(const char * filename);
+    void write(const char * filename) const;
+    int num_docs() const { return (int)offsets.size() - 1; }
+public:
+    int size_vocab;
+    vector<int64_t> offsets;
+    vector<int> words;
+    vector<int> topics;
+    vector<int> tables;
+};
+
+/// the sums of the posterior averages, rows kept sorted, see average.bin
+class posterior_average
+{
+public:
+    bool read(const char * filename);
+    void write(const char * filename) const;
+    int num_topics() const { return (int)weights.size(); }
+    int num_docs() const { return (int)doc_smoothing.size(); }
+public:
+    int num_samples;
+    int iteration;
+    int burn_in;
+    int size_vocab;
+    vector<int>    samples;  // by averaged topic
+    vector<double> weights;
+    vector<double> floors;
+    vector< vector<int> >    words;   // by averaged topic
+    vector< vector<double> > values;
+    vector<double> doc_smoothing;
+    vector< vector<int> >    doc_topics;  // by doc id
+    vector< vector<double> > doc_values;
+    vector<int> topic_of_z;
+};
+
+#endif	/* _OUTPUT_H */
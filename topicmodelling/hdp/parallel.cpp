@@ -0,0 +1,337 @@
+#include "state.h"
+#include "utils.h"
+#include <pthread.h>
+#include <assert.h>
+
+/// approximate distributed sweep, as AD-LDA: each thread samples a slice of
+/// the documents against the counts of the last sweep, keeping its changes
+/// to the topic counts to itself, and the changes are added up when all the
+/// threads are done. a thread keeps only the nonzero changes of the words it
+/// writes, so its memory grows with the changes, not with the topics times
+/// the words. each thread can create TOPICS_PER_THREAD topics, numbered from
+/// m_num_topics up, which are given the next free ids of the shared state as
+/// the changes are added.
+
+#define TOPICS_PER_THREAD 8
+
+extern __thread gsl_rng * RANDOM_NUMBER;
+
+struct sweep_job
+{
+    hdp_state* worker;
+    gsl_rng*   rng;
+    bool       table_sampling;
+};
+
+static void* run_sweep_job(void* arg)
+{
+    sweep_job* job = (sweep_job*)arg;
+    RANDOM_NUMBER = job->rng;
+    job->worker->sweep_docs(true, job->table_sampling);
+    job->worker->finish_worker();
+    return NULL;
+}
+
+void hdp_state::iterate_gibbs_state_parallel(bool table_sampling)
+{
+    int num_threads = m_num_threads;
+    int num_topics = m_num_topics;
+    int p, j;
+    double start = wall_time();
+
+    while ((int)m_workers.size() < num_threads)
+        m_workers.push_back(new hdp_state());
+    set_lgamma_caches();
+
+    /// split the documents into slices of about the same number of words
+    double total = 0.0;
+    for (j = 0; j < m_num_docs; j++) total += m_doc_states[j]->m_doc_length;
+
+    vector <sweep_job> jobs(num_threads);
+    double words = 0.0;
+    int first_doc = 0;
+    for (p = 0; p < num_threads; p++)
+    {
+        int last_doc = first_doc + 1;
+        words += m_doc_states[first_doc]->m_doc_length;
+        if (p + 1 == num_threads) last_doc = m_num_docs;
+        while (last_doc < m_num_docs - (num_threads - p - 1) &&
+               words < total * (p + 1) / num_threads)
+            words += m_doc_states[last_doc++]->m_doc_length;
+
+        setup_worker(m_workers[p], first_doc, last_doc - first_doc);
+        first_doc = last_doc;
+
+        jobs[p].worker = m_workers[p];
+        jobs[p].rng = gsl_rng_alloc(gsl_rng_philox);
+        rng_split(RANDOM_NUMBER, jobs[p].rng, p);
+        jobs[p].table_sampling = table_sampling;
+    }
+
+    vector <pthread_t> threads(num_threads);
+    for (p = 0; p < num_threads; p++)
+    {
+        if (pthread_create(&threads[p], NULL, run_sweep_job, &jobs[p]) != 0)
+        {
+            printf("can't create thread %d.\n", p);
+            exit(1);
+        }
+    }
+    for (p = 0; p < num_threads; p++)
+    {
+        pthread_join(threads[p], NULL);
+        gsl_rng_free(jobs[p].rng);
+    }
+
+    /// the words any of the threads changed
+    int_vec changed;
+    if ((int)m_word_scratch.size() < m_size_vocab)
+        m_word_scratch.resize(m_size_vocab, 0);
+    for (p = 0; p < num_threads; p++)
+    {
+        const int_vec & words = m_workers[p]->m_word_counts_by_wz.m_private_words;
+        for (j = 0; j < (int)words.size(); j++)
+        {
+            if (m_word_scratch[words[j]] == 0) changed.push_back(words[j]);
+            m_word_scratch[words[j]] = 1;
+        }
+    }
+    for (j = 0; j < (int)changed.size(); j++) m_word_scratch[changed[j]] = 0;
+
+    /// the threads changed the tables of different documents, so their
+    /// changes to the table terms add up. the other terms are summed again
+    /// for the rows and topics that changed.
+    bool likelihood_terms = !m_likelihood_dirty;
+    if (likelihood_terms)
+        for (j = 0; j < (int)changed.size(); j++) m_word_terms -= word_terms(changed[j]);
+
+    for (p = 0; p < num_threads; p++)
+        merge_worker(m_workers[p], num_topics);
+    merge_worker_stats(wall_time() - start);
+
+    if (likelihood_terms)
+    {
+        for (j = 0; j < (int)changed.size(); j++) m_word_terms += word_terms(changed[j]);
+        for (p = 0; p < num_threads; p++) m_table_terms += m_workers[p]->m_table_terms;
+        compute_topic_terms();
+    }
+
+    if (sparse_sampler())
+    {
+        /// the word lists of the words the threads changed
+        for (j = 0; j < (int)changed.size(); j++)
+        {
+            int w = changed[j];
+            const int* counts_w = m_word_counts_by_wz.row(w);
+            int_vec & topics = m_topics_by_w[w];
+            topics.clear();
+            for (int k = 0; k < m_num_topics; k++)
+                if (counts_w[k] > 0) topics.push_back(k);
+        }
+        for (int k = 0; k < m_num_topics; k++)
+            update_sparse_topic(k);
+    }
+}
+
+/// let worker sample documents [first_doc, first_doc+num_docs)
+void hdp_state::setup_worker(hdp_state* worker, int first_doc, int num_docs)
+{
+    int size = m_num_topics + TOPICS_PER_THREAD + 1; // with the spare slot of a new topic
+
+    worker->m_base_state = this;
+    worker->m_size_vocab = m_size_vocab;
+    worker->m_num_docs   = num_docs;
+    worker->m_doc_states = m_doc_states + first_doc;
+    worker->m_eta   = m_eta;
+    worker->m_gamma = m_gamma;
+    worker->m_alpha = m_alpha;
+    worker->m_sampler = m_sampler;
+
+    worker->m_num_topics = m_num_topics;
+    worker->m_max_num_topics = m_num_topics + TOPICS_PER_THREAD;
+    worker->m_total_num_tables = m_total_num_tables;
+    worker->m_table_terms = 0.0; // only the change is added back
+    worker->m_stats.reset();
+
+    worker->m_num_tables_by_z.assign(m_num_tables_by_z.begin(), m_num_tables_by_z.begin() + m_num_topics);
+    worker->m_num_tables_by_z.resize(size, 0);
+    worker->m_word_counts_by_z.assign(m_word_counts_by_z.begin(), m_word_counts_by_z.begin() + m_num_topics);
+    worker->m_word_counts_by_z.resize(size, 0);
+
+    worker->m_word_counts_by_wz.track(&m_word_counts_by_wz, m_num_topics, size);
+    /// no count can pass the number of words, so the workers only read them
+    worker->m_lgamma_eta.share(m_lgamma_eta, m_total_words);
+    worker->m_lgamma_v_eta.share(m_lgamma_v_eta, m_total_words);
+
+    if (sparse_sampler())
+    {
+        worker->m_smoothing_by_z.assign(m_smoothing_by_z.begin(), m_smoothing_by_z.begin() + m_num_topics);
+        worker->m_smoothing_by_z.resize(size, 0.0);
+        worker->m_inv_denom_by_z.assign(m_inv_denom_by_z.begin(), m_inv_denom_by_z.begin() + m_num_topics);
+        worker->m_inv_denom_by_z.resize(size, 1.0/(m_size_vocab * m_eta));
+        worker->m_smoothing_sum = m_smoothing_sum;
+        worker->m_topics_by_w.resize(m_size_vocab);
+        worker->m_smoothing_alias.clear();
+        worker->m_sparse_dirty = false;
+    }
+}
+
+/// keep the changes to the row of w, and copy its topic list from the base
+/// state, before the worker or the proposal writes to it
+void hdp_state::touch_word(int w)
+{
+    if (m_word_counts_by_wz.is_private(w)) return;
+    m_word_counts_by_wz.make_private(w);
+    if (sparse_sampler() && !m_sparse_dirty)
+        m_topics_by_w[w] = m_base_state->m_topics_by_w[w];
+}
+
+/// turn the topic counts of a worker into the changes it made to the base
+/// state, its word counts keep only those already. run by the worker thread,
+/// the base state isn't changed until all are done
+void hdp_state::finish_worker()
+{
+    const hdp_state* base = m_base_state;
+    int num_topics = base->m_num_topics;
+    int k;
+
+    for (k = 0; k < num_topics; k++)
+    {
+        m_num_tables_by_z[k]  -= base->m_num_tables_by_z[k];
+        m_word_counts_by_z[k] -= base->m_word_counts_by_z[k];
+    }
+    m_total_num_tables -= base->m_total_num_tables;
+}
+
+/// add the changes of a finished worker, which started from num_topics
+/// topics, giving the topics it created the next free ids
+void hdp_state::merge_worker(const hdp_state* worker, int num_topics)
+{
+    int first_topic = m_num_topics;
+    int k, new_k;
+
+    m_num_topics += worker->m_num_topics - num_topics;
+    while ((int)m_num_tables_by_z.size() < m_num_topics + 1)
+    {
+        m_num_tables_by_z.push_back(0);
+        m_word_counts_by_z.push_back(0);
+    }
+    m_word_counts_by_wz.reserve(m_num_topics + 1);
+
+    for (k = 0; k < worker->m_num_topics; k++)
+    {
+        new_k = k < num_topics ? k : first_topic + k - num_topics;
+        m_num_tables_by_z[new_k]  += worker->m_num_tables_by_z[k];
+        m_word_counts_by_z[new_k] += worker->m_word_counts_by_z[k];
+    }
+    m_total_num_tables += worker->m_total_num_tables;
+
+    const word_topic_counts & changes = worker->m_word_counts_by_wz;
+    for (unsigned int j = 0; j < changes.m_private_words.size(); j++)
+    {
+        int* counts_w = m_word_counts_by_wz.row(changes.m_private_words[j]);
+        const int_vec & changes_w = changes.m_changes[j];
+        for (unsigned int i = 0; i < changes_w.size(); i += 2)
+        {
+            k = changes_w[i];
+            new_k = k < num_topics ? k : first_topic + k - num_topics;
+            counts_w[new_k] += changes_w[i+1];
+        }
+    }
+
+    if (worker->m_num_topics == num_topics) return;
+    for (int j = 0; j < worker->m_num_docs; j++)
+    {
+        doc_state* d_state = worker->m_doc_states[j];
+        for (int t = 0; t < d_state->m_num_tables; t++)
+        {
+            k = d_state->m_table_to_topic[t];
+            if (k >= num_topics)
+                d_state->m_table_to_topic[t] = first_topic + k - num_topics;
+        }
+    }
+}
+
+/// add up the counts of the workers, and split the wall time of the sweep
+/// between word and table sampling as the workers together split theirs
+void hdp_state::merge_worker_stats(double seconds)
+{
+    double word_time = 0.0, table_time = 0.0;
+    for (int p = 0; p < m_num_threads; p++)
+    {
+        const phase_stats & stats = m_workers[p]->m_stats;
+        word_time  += stats.word_time;
+        table_time += stats.table_time;
+        m_stats.tables_created   += stats.tables_created;
+        m_stats.tables_destroyed += stats.tables_destroyed;
+        m_stats.topics_born      += stats.topics_born;
+    }
+    double share = word_time + table_time > 0.0 ? word_time / (word_time + table_time) : 1.0;
+    m_stats.word_time  += seconds * share;
+    m_stats.table_time += seconds * (1.0 - share);
+}
+
+/// the workers don't own the documents or the doc counts they point to
+void hdp_state::free_workers()
+{
+    for (unsigned int p = 0; p < m_workers.size(); p++)
+    {
+        hdp_state* worker = m_workers[p];
+        worker->m_doc_states = NULL;
+        delete worker;
+    }
+    m_workers.clear();
+}
+
+struct move_job
+{
+    hdp_state* state;
+    sm_move*   move;
+    gsl_rng*   rng;
+    int        num_scans;
+};
+
+static void* run_move_job(void* arg)
+{
+    move_job* job = (move_job*)arg;
+    RANDOM_NUMBER = job->rng;
+    job->state->evaluate_move(*job->move, job->num_scans);
+    return NULL;
+}
+
+/// evaluate a batch of split-merge moves, one thread each. the moves don't
+/// share topics, so each one is scored as if it were the only one, and the
+/// caller accepts or rejects them in turn.
+void hdp_state::evaluate_moves(vector <sm_move> & moves, int num_scans)
+{
+    int num_moves = moves.size();
+    int p;
+    for (p = 0; p < num_moves; p++) setup_move(moves[p], p);
+
+    if (num_moves == 1)
+    {
+        evaluate_move(moves[0], num_scans);
+        return;
+    }
+
+    vector <move_job> jobs(num_moves);
+    vector <pthread_t> threads(num_moves);
+    for (p = 0; p < num_moves; p++)
+    {
+        jobs[p].state = this;
+        jobs[p].move = &moves[p];
+        jobs[p].rng = gsl_rng_alloc(gsl_rng_philox);
+        rng_split(RANDOM_NUMBER, jobs[p].rng, p);
+        jobs[p].num_scans = num_scans;
+        if (pthread_create(&threads[p], NULL, run_move_job, &jobs[p]) != 0)
+        {
+            printf("can't create thread %d.\n", p);
+            exit(1);
+        }
+    }
+    for (p = 0; p < num_moves; p++)
+    {
+        pthread_join(threads[p], NULL);
+        gsl_rng_free(jobs[p].rng);
+    }
+}
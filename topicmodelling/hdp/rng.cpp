@@ -0,0 +1,100 @@
+#include "rng.h"
+#include <stdint.h>
+#include <assert.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+#define PHILOX_ROUNDS 10
+
+typedef struct
+{
+    uint32_t key[2];
+    uint32_t ctr[4];  // [0], [1]: block, [2]: iteration, [3]: thread and split
+    uint32_t out[4];  // the numbers of the last block
+    uint32_t used;    // how many of out are used
+    uint32_t splits;  // streams split off in this iteration
+} philox_state_t;
+
+static void philox_block(const uint32_t* ctr, const uint32_t* key, uint32_t* out)
+{
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int r = 0; r < PHILOX_ROUNDS; r++)
+    {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+static void philox_set(void* vstate, unsigned long int seed)
+{
+    philox_state_t* state = (philox_state_t*)vstate;
+    state->key[0] = (uint32_t)seed;
+    state->key[1] = (uint32_t)((uint64_t)seed >> 32);
+    state->ctr[0] = state->ctr[1] = state->ctr[2] = state->ctr[3] = 0;
+    state->used = 4;
+    state->splits = 0;
+}
+
+static unsigned long int philox_get(void* vstate)
+{
+    philox_state_t* state = (philox_state_t*)vstate;
+    if (state->used == 4)
+    {
+        philox_block(state->ctr, state->key, state->out);
+        if (++state->ctr[0] == 0) state->ctr[1]++;
+        state->used = 0;
+    }
+    return state->out[state->used++];
+}
+
+static double philox_get_double(void* vstate)
+{
+    return philox_get(vstate) / 4294967296.0;
+}
+
+static const gsl_rng_type philox_type =
+{
+    "philox4x32-10",
+    0xffffffffUL,
+    0,
+    sizeof(philox_state_t),
+    &philox_set,
+    &philox_get,
+    &philox_get_double
+};
+
+const gsl_rng_type * gsl_rng_philox = &philox_type;
+
+void rng_set_stream(const gsl_rng * r, unsigned int iteration, unsigned int thread)
+{
+    assert(r->type == gsl_rng_philox);
+    philox_state_t* state = (philox_state_t*)r->state;
+    state->ctr[0] = state->ctr[1] = 0;
+    state->ctr[2] = iteration;
+    state->ctr[3] = thread;
+    state->used = 4;
+    state->splits = 0;
+}
+
+void rng_split(const gsl_rng * parent, const gsl_rng * child, unsigned int thread)
+{
+    assert(parent->type == gsl_rng_philox && child->type == gsl_rng_philox);
+    philox_state_t* p = (philox_state_t*)parent->state;
+    philox_state_t* c = (philox_state_t*)child->state;
+    assert(thread < 0x10000);
+
+    p->splits ++;
+    c->key[0] = p->key[0];
+    c->key[1] = p->key[1];
+    rng_set_stream(child, p->ctr[2], (p->splits << 16) | thread);
+}
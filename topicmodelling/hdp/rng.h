@@ -0,0 +1,24 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <gsl/gsl_rng.h>
+
+/// counter-based random numbers: philox4x32-10 (Salmon et al., "parallel
+/// random numbers: as easy as 1, 2, 3", SC 2011) as a gsl_rng type, so the
+/// gsl distributions can draw from it.
+///
+/// the numbers are a keyed hash of a counter. the key is the seed, and the
+/// counter is split into a block number and a stream number made of an
+/// iteration and a thread, so every (seed, iteration, thread) has its own
+/// stream, and none of them depends on how many numbers the others drew.
+
+extern const gsl_rng_type * gsl_rng_philox;
+
+/// restart r at the first number of stream (iteration, thread)
+void rng_set_stream(const gsl_rng * r, unsigned int iteration, unsigned int thread);
+
+/// start child at a stream of its own for thread, in the iteration parent is
+/// in. each split in an iteration gives a different stream.
+void rng_split(const gsl_rng * parent, const gsl_rng * child, unsigned int thread);
+
+#endif // RNG_H
@@ -0,0 +1,275 @@
+#include "server.h"
+#include "utils.h"
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// the fold-in keeps the trained topics fixed and samples only the topic of
+/// each word, with n_dk + alpha * beta_k as the prior of a document. the
+/// mass of a new topic is left out, a new topic has no words to report.
+#define FOLD_IN_ITER 50
+#define FOLD_IN_BURN_IN 25
+/// the longest document folded in, in words, so that a request can't take
+/// all the memory of the server or keep a thread for ever
+#define MAX_FOLD_IN_LENGTH 100000
+
+extern __thread gsl_rng * RANDOM_NUMBER;
+
+resident_model::resident_model()
+{
+    m_size_vocab = 0;
+    m_num_topics = 0;
+    m_eta = m_gamma = m_alpha = 0.0;
+}
+
+void resident_model::load(const char * filename)
+{
+    if (!m_file.map(filename))
+    {
+        printf("%s is not a model of version %d.\n", filename, MODEL_VERSION);
+        exit(1);
+    }
+    const model_header * header = m_file.header;
+    m_size_vocab = header->size_vocab;
+    m_num_topics = header->num_topics;
+    m_eta   = header->eta;
+    m_gamma = header->gamma;
+    m_alpha = header->alpha;
+
+    /// beta_k = m_k / (m + gamma), the weight of topic k at the top level
+    double num_tables = 0.0;
+    for (int k = 0; k < m_num_topics; k++)
+        num_tables += m_file.tables_by_z[k];
+
+    m_prior.resize(m_num_topics);
+    m_inv_denom.resize(m_num_topics);
+    for (int k = 0; k < m_num_topics; k++)
+    {
+        m_prior[k] = m_alpha * m_file.tables_by_z[k] / (num_tables + m_gamma);
+        m_inv_denom[k] = 1.0 / (m_file.words_by_z[k] + m_size_vocab * m_eta);
+    }
+}
+
+void resident_model::fold_in(const vector<int> & words, const vector<int> & counts,
+                             vector<double> & theta) const
+{
+    int num_topics = m_num_topics;
+    int num_words = 0;
+    for (unsigned int n = 0; n < counts.size(); n++) num_words += counts[n];
+    theta.assign(num_topics, 0.0);
+    if (num_topics == 0) return;
+    if (num_words == 0)
+    {
+        double total = 0.0;
+        for (int k = 0; k < num_topics; k++) total += m_prior[k];
+        for (int k = 0; k < num_topics; k++) theta[k] = m_prior[k] / total;
+        return;
+    }
+
+    vector<int> z(num_words);
+    vector<int> counts_by_z(num_topics, 0);
+    vector<double> p(num_topics);
+    vector<double> word_terms(num_topics);
+
+    /// the first sweep adds the words one at a time, the later ones resample.
+    /// the copies of a word come one after the other, and share its counts
+    for (int iter = 0; iter < FOLD_IN_ITER; iter++)
+    {
+        int i = 0;
+        for (unsigned int n = 0; n < words.size(); n++)
+        {
+            int w = words[n];
+            for (int k = 0; k < num_topics; k++)
+                word_terms[k] = count(k, w) + m_eta;
+            for (int c = 0; c < counts[n]; c++, i++)
+            {
+                if (iter > 0) counts_by_z[z[i]] --;
+
+                double total = 0.0;
+                for (int k = 0; k < num_topics; k++)
+                {
+                    total += (counts_by_z[k] + m_prior[k]) * word_terms[k] * m_inv_denom[k];
+                    p[k] = total;
+                }
+                double u = runiform() * total;
+                int k = 0;
+                while (k < num_topics - 1 && p[k] < u) k++;
+
+                z[i] = k;
+                counts_by_z[k] ++;
+            }
+        }
+        if (iter >= FOLD_IN_BURN_IN)
+        {
+            for (int k = 0; k < num_topics; k++)
+                theta[k] += counts_by_z[k] + m_prior[k];
+        }
+    }
+
+    double total = 0.0;
+    for (int k = 0; k < num_topics; k++) total += theta[k];
+    for (int k = 0; k < num_topics; k++) theta[k] /= total;
+}
+
+/// the words and counts of a document line in the lda-c format, leaving out
+/// the words the model doesn't know. NULL if it is a document, otherwise
+/// what is wrong with it
+static const char * parse_document(const char * line, int size_vocab,
+                                   vector<int> & words, vector<int> & counts)
+{
+    words.clear();
+    counts.clear();
+    char * end;
+    long length = strtol(line, &end, 10);
+    if (end == line || length < 0) return "isn't in the lda-c format";
+
+    long doc_length = 0;
+    for (long n = 0; n < length; n++)
+    {
+        const char * p = end;
+        long w = strtol(p, &end, 10);
+        if (end == p || *end != ':') return "isn't in the lda-c format";
+        p = end + 1;
+        long count = strtol(p, &end, 10);
+        if (end == p || count < 0) return "isn't in the lda-c format";
+        if (count > MAX_FOLD_IN_LENGTH - doc_length) return "is too long";
+        doc_length += count;
+        if (w < 0 || w >= size_vocab || count == 0) continue;
+        words.push_back(w);
+        counts.push_back(count);
+    }
+    return NULL;
+}
+
+void serve_stream(FILE * in, FILE * out, const vector<resident_model*> & models)
+{
+    char * line = NULL;
+    size_t capacity = 0;
+    vector<int> words, counts;
+    vector<double> theta;
+
+    while (getline(&line, &capacity, in) > 0)
+    {
+        int m, num_docs;
+        if (sscanf(line, "%d %d", &m, &num_docs) != 2 || num_docs < 0)
+        {
+            fprintf(out, "error: a request starts with \"model num_docs\"\n");
+            fflush(out);
+            continue;
+        }
+
+        const resident_model * model = NULL;
+        if (m >= 0 && m < (int)models.size())
+        {
+            model = models[m];
+            fprintf(out, "%d %d\n", num_docs, model->m_num_topics);
+        }
+        else
+            fprintf(out, "error: no model %d\n", m);
+
+        /// the documents of a bad request are read and dropped
+        for (int d = 0; d < num_docs && getline(&line, &capacity, in) > 0; d++)
+        {
+            if (model == NULL) continue;
+            const char * error = parse_document(line, model->m_size_vocab, words, counts);
+            if (error != NULL)
+            {
+                fprintf(out, "error: document %d %s\n", d, error);
+                continue;
+            }
+            model->fold_in(words, counts, theta);
+            for (int k = 0; k < model->m_num_topics; k++)
+                fprintf(out, k == 0 ? "%.6f" : " %.6f", theta[k]);
+            fprintf(out, "\n");
+        }
+        fflush(out);
+    }
+    free(line);
+}
+
+struct connection
+{
+    int  fd;
+    const vector<resident_model*> * models;
+    long seed;
+    unsigned int num; // connections accepted before this one
+};
+
+static void* run_connection(void* arg)
+{
+    connection* conn = (connection*)arg;
+
+    /// each connection has the stream of its number, as an iteration does
+    RANDOM_NUMBER = gsl_rng_alloc(gsl_rng_philox);
+    gsl_rng_set(RANDOM_NUMBER, conn->seed);
+    rng_set_stream(RANDOM_NUMBER, conn->num, 0);
+
+    FILE * in = fdopen(conn->fd, "r");
+    FILE * out = fdopen(dup(conn->fd), "w");
+    if (in != NULL && out != NULL)
+        serve_stream(in, out, *conn->models);
+    if (in != NULL) fclose(in); else close(conn->fd);
+    if (out != NULL) fclose(out);
+
+    gsl_rng_free(RANDOM_NUMBER);
+    RANDOM_NUMBER = NULL;
+    delete conn;
+    return NULL;
+}
+
+void serve_socket(const char * path, const vector<resident_model*> & models, long seed)
+{
+    /// a client that goes away shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("socket path %s is too long.\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0)
+    {
+        printf("can't listen on %s.\n", path);
+        exit(1);
+    }
+    printf("serving %d models on %s\n", (int)models.size(), path);
+    fflush(stdout);
+
+    for (unsigned int num = 0; ; num++)
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) { num--; continue; }
+            printf("can't accept on %s.\n", path);
+            exit(1);
+        }
+
+        connection* conn = new connection;
+        conn->fd = client;
+        conn->models = &models;
+        conn->seed = seed;
+        conn->num = num;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_connection, conn) != 0)
+        {
+            printf("can't create thread %d.\n", num);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// end of the file
@@ -0,0 +1,55 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <vector>
+#include <stdio.h>
+#include <stddef.h>
+#include "model.h"
+using namespace std;
+
+/// --algorithm serve: trained models kept in memory, folding in documents
+/// sent on stdin or on a unix socket.
+///
+/// a request is a line "model num_docs" followed by num_docs documents, one
+/// per line in the lda-c format. the reply is a line "num_docs num_topics"
+/// followed by a line of num_topics topic proportions for each document, or
+/// a line starting with "error" for a request or document that can't be read.
+
+/// a model saved by save_state_ex(), or a checkpoint, mapped read-only.
+/// requests share it and never write it, the fold-in keeps its counts to
+/// itself.
+class resident_model
+{
+public:
+    int    m_size_vocab;
+    int    m_num_topics;
+    double m_eta;
+    double m_gamma;
+    double m_alpha;
+
+    vector<double> m_prior;     // alpha * beta_k, the weights of the trained topics
+    vector<double> m_inv_denom; // 1 / (n_k + V*eta)
+private:
+    model_file m_file;
+public:
+    resident_model();
+    void load(const char * filename);
+    int count(int k, int w) const
+    {
+        return m_file.count(w, k);
+    }
+    /// the topic proportions of a document of counts[n] copies of each
+    /// words[n], averaged over the sweeps after the burn-in, drawing from the
+    /// RANDOM_NUMBER of the calling thread
+    void fold_in(const vector<int> & words, const vector<int> & counts,
+                 vector<double> & theta) const;
+};
+
+/// answer the requests read from in until it ends
+void serve_stream(FILE * in, FILE * out, const vector<resident_model*> & models);
+
+/// answer the connections to a unix socket at path, each on a thread of its
+/// own with its own random stream, until the process is killed
+void serve_socket(const char * path, const vector<resident_model*> & models, long seed);
+
+#endif // SERVER_H
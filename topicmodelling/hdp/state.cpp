@@ -1,18 +1,39 @@
 #include "state.h"
 #include "utils.h"
+#include "topic_kernel.h"
 #include <assert.h>
+#include <limits.h>
+#include <algorithm>
 
 #define SMALL_GIBBS_MAX_ITER 20
 #define VERBOSE false
 #define INIT_SIZE 50
 #define INF -1e50
+#define LIKELIHOOD_CHECK_LAG 50 // recompute the likelihood terms every this many likelihoods
+#define SMOOTHING_DRIFT 2.0 // ALIAS_SAMPLER rebuilds its smoothing table when the masses drift this much
+#define SMOOTHING_TRIES 32 // rejections before draw_smoothing_topic() scans the topics
+#define TABLE_MH_STEPS 4 // metropolis-hastings steps per table topic draw of ALIAS_SAMPLER
+#define NEW_TOPIC_PROPOSAL 0.25 // chance a table is proposed a new topic
+
+/// the change of lgamma(n + a) when n moves by update. lgamma(n+1+a) -
+/// lgamma(n+a) = log(n+a), so a move by one costs a log. for a == 0 the
+/// term of n == 0 is left out of the sums, lgamma(0) being infinite.
+static inline double lgamma_change(int n, int update, double a)
+{
+    if (update == 1)  return n + a > 0 ? log(n + a) : 0.0;
+    if (update == -1) return n - 1 + a > 0 ? -log(n - 1 + a) : 0.0;
+    double before = n + a > 0 ? lgamma(n + a) : 0.0;
+    double after  = n + update + a > 0 ? lgamma(n + update + a) : 0.0;
+    return after - before;
+}
 
 doc_state::doc_state()
 {
     m_doc_id = -1; // document id
     m_doc_length = 0;  // document length
     m_num_tables = 0;  // number of tables in this document
-    m_words = NULL;
+    m_token_words = NULL;
+    m_token_tables = NULL;
 
     m_table_to_topic.clear(); // for a doc, translate its table index to topic index
     m_word_counts_by_t.clear(); // word counts for each table
@@ -24,13 +45,14 @@ doc_state::~doc_state()
     free_doc_state();
 }
 
-void doc_state::setup_state_from_doc(const document * doc)
+void doc_state::setup_state_from_doc(const document * doc, uint32_t * words, table_id * tables)
 {
     m_doc_id = doc->id;
     m_doc_length = doc->total;
 
     int word, count;
-    m_words = new word_info[doc->total];
+    m_token_words = words;
+    m_token_tables = tables;
     int m = 0;
     for (int n = 0; n < doc->length; n++)
     {
@@ -38,9 +60,8 @@ void doc_state::setup_state_from_doc(const document * doc)
         count = doc->counts[n];
         for (int j = 0; j < count; j++)
         {
-            m_words[m].m_word_index = word;
-            m_words[m].m_table_assignment = -1;
-            //m_words[m].m_topic_assignment = -1;
+            m_token_words[m] = word;
+            m_token_tables[m] = NO_TABLE;
             m++;
         }
     }
@@ -49,19 +70,43 @@ void doc_state::setup_state_from_doc(const document * doc)
     m_word_counts_by_t.resize(INIT_SIZE, 0);
 }
 
+/// the word counts of the topics of the document, by topic, added up from
+/// its tables. a document has few topics, so they are kept in order by
+/// inserting.
+void doc_state::topic_counts(int_vec & topics, int_vec & counts) const
+{
+    topics.clear();
+    counts.clear();
+    for (int t = 0; t < m_num_tables; t++)
+    {
+        int k = m_table_to_topic[t];
+        if (k < 0 || m_word_counts_by_t[t] == 0) continue;
+        int_vec::iterator it = lower_bound(topics.begin(), topics.end(), k);
+        int j = it - topics.begin();
+        if (it == topics.end() || *it != k)
+        {
+            topics.insert(it, k);
+            counts.insert(counts.begin() + j, 0);
+        }
+        counts[j] += m_word_counts_by_t[t];
+    }
+}
+
 void doc_state::free_doc_state()
 {
     m_table_to_topic.clear(); // for a doc, translate its table index to topic index
     m_word_counts_by_t.clear(); // word counts for each table
     m_word_stats_by_t.clear();
 
-    delete [] m_words;
-    m_words = NULL;
+    m_token_words = NULL;
+    m_token_tables = NULL;
 }
 
 hdp_state::hdp_state()
 {
     m_doc_states = NULL;
+    m_token_words = NULL;
+    m_token_tables = NULL;
     m_size_vocab = 0;
     m_total_words = 0;;
     m_num_docs = 0;
@@ -69,8 +114,23 @@ hdp_state::hdp_state()
     m_total_num_tables = 0;
     m_num_tables_by_z.clear();
     m_word_counts_by_z.clear();
-    m_word_counts_by_zd.clear();
-    m_word_counts_by_zw.clear();
+
+    m_sampler = DENSE_SAMPLER;
+    m_sparse_dirty = true;
+    m_smoothing_sum = 0.0;
+    m_smoothing_bound = 1.0;
+
+    m_likelihood_dirty = true;
+    m_num_likelihoods = 0;
+    m_table_terms = m_topic_terms = m_topic_word_terms = m_word_terms = 0.0;
+
+    m_num_threads = 1;
+    m_base_state = NULL;
+    m_max_num_topics = INT_MAX;
+    m_base_num_topics = 0;
+    m_output_format = TEXT_OUTPUT;
+    m_log = stdout;
+    m_average = NULL;
 }
 
 hdp_state::~hdp_state()
@@ -85,12 +145,19 @@ void hdp_state::setup_state_from_corpus(const corpus * c)
     m_num_docs = c->num_docs;
     m_doc_states = new doc_state * [m_num_docs];
 
-    for (unsigned int d = 0; d < c->docs.size(); d++)
+    size_t num_words = 0;
+    for (int d = 0; d < m_num_docs; d++) num_words += c->docs[d].total;
+    m_token_words = new uint32_t [num_words];
+    m_token_tables = new table_id [num_words];
+
+    size_t offset = 0;
+    for (int d = 0; d < m_num_docs; d++)
     {
-        document * doc      = c->docs[d];
-        doc_state * d_state = new doc_state();
-        m_doc_states[d]     = d_state;
-        d_state->setup_state_from_doc(doc);
+        const document * doc = &c->docs[d];
+        doc_state * d_state  = new doc_state();
+        m_doc_states[d]      = d_state;
+        d_state->setup_state_from_doc(doc, m_token_words + offset, m_token_tables + offset);
+        offset += doc->total;
     }
 }
 
@@ -101,19 +168,7 @@ void hdp_state::allocate_initial_space()
     {
         m_num_tables_by_z.resize(INIT_SIZE, 0);
         m_word_counts_by_z.resize(INIT_SIZE, 0);
-        m_word_counts_by_zd.resize(INIT_SIZE, NULL);
-        m_word_counts_by_zw.resize(INIT_SIZE, NULL);
-        int * p = NULL;
-        for (int k = 0; k < INIT_SIZE; k++)
-        {
-            p = new int [m_num_docs];
-            memset(p, 0, sizeof(int)*m_num_docs);
-            m_word_counts_by_zd[k] = p;
-
-            p = new int [m_size_vocab];
-            memset(p, 0, sizeof(int)*m_size_vocab);
-            m_word_counts_by_zw[k] = p;
-        }
+        m_word_counts_by_wz.allocate(m_size_vocab, INIT_SIZE);
     }
     else // testing
     {
@@ -121,22 +176,16 @@ void hdp_state::allocate_initial_space()
         {
             m_num_tables_by_z.push_back(0);
             m_word_counts_by_z.push_back(0);
-
-            int* p = new int [m_size_vocab];
-            memset(p, 0, sizeof(int)*m_size_vocab);
-            m_word_counts_by_zw.push_back(p);
-        }
-        while ((int)m_word_counts_by_zd.size() < m_num_topics + 1)
-        {
-            int* p = new int [m_num_docs];
-            memset(p, 0, sizeof(int)*m_num_docs);
-            m_word_counts_by_zd.push_back(p);
         }
+        m_word_counts_by_wz.reserve(m_num_topics + 1);
     }
 }
 
 void hdp_state::free_state()
 {
+    free_workers();
+    free_proposals();
+
     if (m_doc_states != NULL)
     {
         for (int d = 0; d < m_num_docs; d++)
@@ -147,6 +196,10 @@ void hdp_state::free_state()
         delete [] m_doc_states;
     }
     m_doc_states = NULL;
+    delete [] m_token_words;
+    delete [] m_token_tables;
+    m_token_words = NULL;
+    m_token_tables = NULL;
 
     m_size_vocab = 0;
     m_total_words = 0;;
@@ -157,8 +210,18 @@ void hdp_state::free_state()
     m_num_tables_by_z.clear();
     m_word_counts_by_z.clear();
 
-    free_vec_ptr(m_word_counts_by_zd);
-    free_vec_ptr(m_word_counts_by_zw);
+    m_word_counts_by_wz.free_counts();
+    m_tables_by_z.clear();
+
+    m_topics_by_w.clear();
+    m_smoothing_by_z.clear();
+    m_inv_denom_by_z.clear();
+    m_smoothing_sum = 0.0;
+    m_sparse_dirty = true;
+    m_likelihood_dirty = true;
+
+    delete m_average;
+    m_average = NULL;
 }
 
 void hdp_state::init_gibbs_state_using_docs()
@@ -167,23 +230,12 @@ void hdp_state::init_gibbs_state_using_docs()
     rshuffle(p->data, m_num_docs, sizeof(size_t)); // shuffle the sequence
 
     /// allocate some space
-    int k, d, i, j, doc_id, w;
+    int k, d, i, j, w;
 
     m_num_tables_by_z.resize(m_num_topics+1, 0);
     m_word_counts_by_z.resize(m_num_topics+1, 0);
 
-    free_vec_ptr(m_word_counts_by_zd);
-    free_vec_ptr(m_word_counts_by_zw);
-    m_word_counts_by_zd.resize(m_num_topics+1, NULL);
-    m_word_counts_by_zw.resize(m_num_topics+1, NULL);
-
-    for (k = 0; k < m_num_topics+1; k ++)
-    {
-        m_word_counts_by_zd[k] = new int[m_num_docs];
-        memset(m_word_counts_by_zd[k], 0, sizeof(int)*m_num_docs);
-        m_word_counts_by_zw[k] = new int[m_size_vocab];
-        memset(m_word_counts_by_zw[k], 0, sizeof(int)*m_size_vocab);
-    }
+    m_word_counts_by_wz.allocate(m_size_vocab, m_num_topics+1);
 
     for (j = 0; j < m_num_topics; j ++) /// assign each doc a table and a topic
     {
@@ -195,8 +247,6 @@ void hdp_state::init_gibbs_state_using_docs()
         m_total_num_tables ++; /// increase a topic
         m_num_tables_by_z[k] ++;
         m_word_counts_by_z[k] += d_state->m_doc_length;
-        doc_id = d_state->m_doc_id;
-        m_word_counts_by_zd[k][doc_id] = d_state->m_doc_length;
 
         /// update the local book keepings
         d_state->m_num_tables = 1;
@@ -206,12 +256,15 @@ void hdp_state::init_gibbs_state_using_docs()
         d_state->m_word_counts_by_t[0] = d_state->m_doc_length;
         for (i = 0; i < d_state->m_doc_length; i++)
         {
-            w = d_state->m_words[i].m_word_index;
-            m_word_counts_by_zw[k][w] ++;
-            d_state->m_words[i].m_table_assignment = 0;
+            w = d_state->m_token_words[i];
+            m_word_counts_by_wz(w, k) ++;
+            d_state->m_token_tables[i] = 0;
         }
     }
 
+    if (sparse_sampler()) rebuild_sparse_state();
+    else rebuild_topic_denoms();
+
     double_vec q;
     double_vec f;
     for (j = m_num_topics; j < m_num_docs; j++)
@@ -225,6 +278,7 @@ void hdp_state::init_gibbs_state_using_docs()
         }
     }
     gsl_permutation_free(p);
+    m_likelihood_dirty = true;
 }
 
 void hdp_state::init_gibbs_state_with_fixed_num_topics()
@@ -233,23 +287,12 @@ void hdp_state::init_gibbs_state_with_fixed_num_topics()
     rshuffle(p->data, m_num_docs, sizeof(size_t)); // shuffle the sequence
 
     /// allocate some space
-    int k, d, i, j, doc_id, w;
+    int k = 0, d, i, j, w;
 
     m_num_tables_by_z.resize(m_num_topics+1, 0);
     m_word_counts_by_z.resize(m_num_topics+1, 0);
 
-    free_vec_ptr(m_word_counts_by_zd);
-    free_vec_ptr(m_word_counts_by_zw);
-    m_word_counts_by_zd.resize(m_num_topics+1, NULL);
-    m_word_counts_by_zw.resize(m_num_topics+1, NULL);
-
-    for (k = 0; k < m_num_topics+1; k ++)
-    {
-        m_word_counts_by_zd[k] = new int[m_num_docs];
-        memset(m_word_counts_by_zd[k], 0, sizeof(int)*m_num_docs);
-        m_word_counts_by_zw[k] = new int[m_size_vocab];
-        memset(m_word_counts_by_zw[k], 0, sizeof(int)*m_size_vocab);
-    }
+    m_word_counts_by_wz.allocate(m_size_vocab, m_num_topics+1);
 
     for (j = 0; j < m_num_topics; j ++) /// assign each doc a table and a topic
     {
@@ -261,8 +304,6 @@ void hdp_state::init_gibbs_state_with_fixed_num_topics()
         m_total_num_tables ++; /// increase a topic
         m_num_tables_by_z[k] ++;
         m_word_counts_by_z[k] += d_state->m_doc_length;
-        doc_id = d_state->m_doc_id;
-        m_word_counts_by_zd[k][doc_id] += d_state->m_doc_length;
 
         /// update the local book keepings
         d_state->m_num_tables = 1;
@@ -272,34 +313,61 @@ void hdp_state::init_gibbs_state_with_fixed_num_topics()
         d_state->m_word_counts_by_t[0] = d_state->m_doc_length;
         for (i = 0; i < d_state->m_doc_length; i++)
         {
-            w = d_state->m_words[i].m_word_index;
-            m_word_counts_by_zw[k][w] ++;
-            d_state->m_words[i].m_table_assignment = 0;
+            w = d_state->m_token_words[i];
+            m_word_counts_by_wz(w, k) ++;
+            d_state->m_token_tables[i] = 0;
         }
     }
 
-    int j0;
-    double total_q;
-    double prob;
-    double* q  = new double[m_num_topics];
-    int* v = new int[m_size_vocab];
+    /// the other documents go one by one to a topic drawn in proportion to
+    /// the cosine similarity of their word counts and those of the topics so
+    /// far. the similarities are computed over the distinct words of the
+    /// document only, with the squared norms of the topics kept as they grow.
+    double_vec norm2_by_z(m_num_topics, 0.0);
+    for (w = 0; w < m_size_vocab; w++)
+    {
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        for (k = 0; k < m_num_topics; k++)
+            norm2_by_z[k] += (double)counts_w[k] * counts_w[k];
+    }
+
+    if ((int)m_word_scratch.size() < m_size_vocab)
+        m_word_scratch.resize(m_size_vocab, 0);
+    int_vec doc_words;
+    double_vec dot(m_num_topics);
+    double_vec q(m_num_topics);
+    int j0, m, c;
+    double total_q, norm2_d;
 
     for (j = m_num_topics; j < m_num_docs; j++)
     {
         d = gsl_permutation_get(p, j);
         doc_state* d_state = m_doc_states[d];
-        total_q = 0;
 
-        memset(v, 0, sizeof(int) * m_size_vocab);
+        doc_words.clear();
         for (i = 0; i < d_state->m_doc_length; i++)
         {
-            w = d_state->m_words[i].m_word_index;
-            v[w] ++;
+            w = d_state->m_token_words[i];
+            if (m_word_scratch[w] == 0) doc_words.push_back(w);
+            m_word_scratch[w] ++;
+        }
+
+        norm2_d = 0.0;
+        dot.assign(m_num_topics, 0.0);
+        for (m = 0; m < (int)doc_words.size(); m++)
+        {
+            w = doc_words[m];
+            c = m_word_scratch[w];
+            norm2_d += (double)c * c;
+            const int* counts_w = m_word_counts_by_wz.row(w);
+            for (k = 0; k < m_num_topics; k++)
+                dot[k] += (double)c * counts_w[k];
         }
+
+        total_q = 0;
         for (j0 = 0; j0 < m_num_topics; j0 ++)
         {
-            prob = similarity(v, m_word_counts_by_zw[k], m_size_vocab);
-            total_q += prob;
+            if (dot[j0] > 0.0) total_q += dot[j0] / sqrt(norm2_d * norm2_by_z[j0]);
             q[j0] = total_q;
         }
 
@@ -312,8 +380,6 @@ void hdp_state::init_gibbs_state_with_fixed_num_topics()
         m_total_num_tables ++; /// increase a topic
         m_num_tables_by_z[k] ++;
         m_word_counts_by_z[k] += d_state->m_doc_length;
-        doc_id = d_state->m_doc_id;
-        m_word_counts_by_zd[k][doc_id] += d_state->m_doc_length;
 
         d_state->m_num_tables = 1;
         d_state->m_table_to_topic.resize(2, -1);
@@ -322,14 +388,20 @@ void hdp_state::init_gibbs_state_with_fixed_num_topics()
         d_state->m_word_counts_by_t[0] = d_state->m_doc_length;
 
         for (i = 0; i < d_state->m_doc_length; i++)
+            d_state->m_token_tables[i] = 0;
+        for (m = 0; m < (int)doc_words.size(); m++)
         {
-            w = d_state->m_words[i].m_word_index;
-            m_word_counts_by_zw[k][w] ++;
-            d_state->m_words[i].m_table_assignment = 0;
+            w = doc_words[m];
+            c = m_word_scratch[w];
+            int & count = m_word_counts_by_wz(w, k);
+            norm2_by_z[k] += 2.0 * count * c + (double)c * c;
+            count += c;
+            m_word_scratch[w] = 0;
         }
     }
     gsl_permutation_free(p);
-    delete [] q; delete [] v;
+    m_sparse_dirty = true;
+    m_likelihood_dirty = true;
 
 }
 
@@ -341,40 +413,95 @@ void hdp_state::iterate_gibbs_state(bool remove, bool permute,
     {
         rshuffle(m_doc_states, m_num_docs, sizeof(doc_state*));
         for (int j = 0; j < m_num_docs; j++)
-            rshuffle(m_doc_states[j]->m_words, m_doc_states[j]->m_doc_length, sizeof(word_info));
+            permute_tokens(m_doc_states[j]);
     }
 
+    double start = wall_time();
+    if (sparse_sampler() && m_sparse_dirty) rebuild_sparse_state();
+    m_stats.word_time += wall_time() - start;
+
+    /// the first sweep adds the words one by one, it stays sequential
+    if (remove && m_num_threads > 1 && m_num_docs >= m_num_threads)
+        iterate_gibbs_state_parallel(table_sampling);
+    else
+        sweep_docs(remove, table_sampling);
+
+    start = wall_time();
+    compact_hdp_state();
+    m_stats.compact_time += wall_time() - start;
+
+    //if (!state_check_sum()) exit(0);
+
+    /// sampling hyperparameters, including first and second levels
+    start = wall_time();
+    if (hdp_hyperparam->m_sample_hyperparameter)
+    {
+        sample_first_level_concentration(hdp_hyperparam);
+        sample_second_level_concentration(hdp_hyperparam);
+    }
+    m_stats.hyper_time += wall_time() - start;
+}
+
+void hdp_state::sweep_docs(bool remove, bool table_sampling)
+{
     double_vec q;
     double_vec f;
     doc_state* d_state = NULL;
+    double start, words_done;
+    if (!sparse_sampler()) rebuild_topic_denoms();
     for (int j = 0; j < m_num_docs; j++)
     {
         d_state = m_doc_states[j];
+        start = wall_time();
+        if (m_word_counts_by_wz.m_tracking)
+            m_word_counts_by_wz.load_rows(d_state->m_token_words, d_state->m_doc_length);
         for (int i = 0; i < d_state->m_doc_length; i++)
         {
             sample_word_assignment(d_state, i, remove, q, f);
         }
-        if (table_sampling) sample_tables(d_state, q, f);
-
+        words_done = wall_time();
+        m_stats.word_time += words_done - start;
+        if (table_sampling)
+        {
+            sample_tables(d_state, q, f);
+            m_stats.table_time += wall_time() - words_done;
+        }
+        if (m_word_counts_by_wz.m_tracking) m_word_counts_by_wz.save_rows();
     }
-    compact_hdp_state();
-
-    //if (!state_check_sum()) exit(0);
+}
 
-    /// sampling hyperparameters, including first and second levels
-    if (hdp_hyperparam->m_sample_hyperparameter)
-    {
-        sample_first_level_concentration(hdp_hyperparam);
-        sample_second_level_concentration(hdp_hyperparam);
-    }
+/// shuffle the tokens of a document. the order is drawn as a permutation of
+/// their positions, which takes the same numbers as shuffling them in place,
+/// and the words and the tables are then moved to it.
+void hdp_state::permute_tokens(doc_state* d_state)
+{
+    int n = d_state->m_doc_length;
+    if (n == 0) return;
+    if ((int)m_token_order.size() < n)
+    {
+        m_token_order.resize(n);
+        m_token_scratch.resize(n);
+    }
+    int* order = &m_token_order[0];
+    int* scratch = &m_token_scratch[0];
+    int i;
+    for (i = 0; i < n; i++) order[i] = i;
+    rshuffle(order, n, sizeof(int));
+
+    for (i = 0; i < n; i++) scratch[i] = d_state->m_token_words[order[i]];
+    for (i = 0; i < n; i++) d_state->m_token_words[i] = scratch[i];
+    for (i = 0; i < n; i++) scratch[i] = d_state->m_token_tables[order[i]];
+    for (i = 0; i < n; i++) d_state->m_token_tables[i] = scratch[i];
 }
 
 void hdp_state::compact_doc_state(doc_state* d_state, int* k_to_new_k)
 {
     int num_tables_old = d_state->m_num_tables;
-    int* t_to_new_t = new int[num_tables_old];
+    if ((int)m_table_scratch.size() < num_tables_old + 1)
+        m_table_scratch.resize(num_tables_old + 1);
+    int* t_to_new_t = &m_table_scratch[0];
 
-    int t, new_t, k, w;
+    int t, new_t, k;
     for (t = 0, new_t = 0; t < num_tables_old; t++)
     {
         if (d_state->m_word_counts_by_t[t] > 0)
@@ -390,30 +517,79 @@ void hdp_state::compact_doc_state(doc_state* d_state, int* k_to_new_k)
     }
     d_state->m_num_tables = new_t;
 
-    d_state->m_word_stats_by_t.clear();
-    d_state->m_word_stats_by_t.resize(d_state->m_num_tables, word_stats());
-
     for (int i = 0; i < d_state->m_doc_length; i++)
     {
-        t = d_state->m_words[i].m_table_assignment;
+        t = d_state->m_token_tables[i];
         new_t =  t_to_new_t[t];
-        d_state->m_words[i].m_table_assignment = new_t;
-        w = d_state->m_words[i].m_word_index;
-        d_state->m_word_stats_by_t[new_t][w] ++;
+        d_state->m_token_tables[i] = new_t;
     }
+    build_word_stats(d_state);
     /*
+         const word_stats & stats = d_state->m_word_stats_by_t;
          for (t = 0; t < d_state->m_num_tables; t ++)
          {
              int sum = 0;
-             word_stats::iterator it;
-             for (it = d_state->m_word_stats_by_t[t].begin(); it != d_state->m_word_stats_by_t[t].end(); it++)
+             for (int m = 0; m < stats.size(t); m++)
              {
-                 sum += (*it).second;
+                 sum += stats.counts(t)[m];
              }
              assert(sum == d_state->m_word_counts_by_t[t]);
          }
     */
-    delete [] t_to_new_t;
+}
+
+/// rebuild the word histogram of every table from the current assignments
+void hdp_state::build_word_stats(doc_state* d_state)
+{
+    word_stats & stats = d_state->m_word_stats_by_t;
+    int num_tables = d_state->m_num_tables;
+    int doc_length = d_state->m_doc_length;
+    int t, i, m, w, n;
+
+    /// group the words of the document by table, in the document order,
+    /// m_offsets[t] is used as the cursor and ends at the end of table t
+    stats.m_offsets.resize(num_tables + 1);
+    if ((int)m_table_tokens.size() < doc_length)
+        m_table_tokens.resize(doc_length);
+    for (t = 0, n = 0; t < num_tables; t++)
+    {
+        stats.m_offsets[t] = n;
+        n += d_state->m_word_counts_by_t[t];
+    }
+    for (i = 0; i < doc_length; i++)
+    {
+        t = d_state->m_token_tables[i];
+        m_table_tokens[stats.m_offsets[t]++] = d_state->m_token_words[i];
+    }
+
+    /// collapse each table into its distinct words
+    if ((int)m_word_scratch.size() < m_size_vocab)
+        m_word_scratch.resize(m_size_vocab, 0);
+    if ((int)stats.m_words.size() < doc_length)
+    {
+        stats.m_words.resize(doc_length);
+        stats.m_counts.resize(doc_length);
+    }
+    int begin = 0, end, first;
+    for (t = 0, n = 0; t < num_tables; t++)
+    {
+        end = stats.m_offsets[t];
+        stats.m_offsets[t] = first = n;
+        for (m = begin; m < end; m++)
+        {
+            w = m_table_tokens[m];
+            if (m_word_scratch[w] == 0) stats.m_words[n++] = w;
+            m_word_scratch[w] ++;
+        }
+        for (m = first; m < n; m++)
+        {
+            w = stats.m_words[m];
+            stats.m_counts[m] = m_word_scratch[w];
+            m_word_scratch[w] = 0;
+        }
+        begin = end;
+    }
+    stats.m_offsets[num_tables] = n;
 }
 
 //compress the unused tables and components
@@ -424,233 +600,244 @@ void hdp_state::compact_hdp_state()
     int k, new_k;
     for (k = 0, new_k = 0; k < num_topics_old; k++)
     {
+        k_to_new_k[k] = -1;
         if (m_word_counts_by_z[k] > 0)
         {
             k_to_new_k[k] = new_k;
             swap_vec_element(m_word_counts_by_z,  new_k, k);
             swap_vec_element(m_num_tables_by_z,   new_k, k);
-            swap_vec_element(m_word_counts_by_zd, new_k, k);
-            swap_vec_element(m_word_counts_by_zw, new_k, k);
+            if (sparse_sampler() && !m_sparse_dirty)
+            {
+                swap_vec_element(m_smoothing_by_z, new_k, k);
+                swap_vec_element(m_inv_denom_by_z, new_k, k);
+            }
             new_k ++;
         }
     }
     m_num_topics = new_k;
+    m_word_counts_by_wz.compact(k_to_new_k, num_topics_old, m_num_topics);
 
-    doc_state* d_state = NULL;
-    for (int j = 0; j < m_num_docs; j++)
+    /// the averaged topics follow the topics they are of
+    if (m_average != NULL)
     {
-        d_state = m_doc_states[j];
-        compact_doc_state(d_state, k_to_new_k);
+        int_vec & topic_of_z = m_average->topic_of_z;
+        int_vec new_topic_of_z(m_num_topics, -1);
+        for (k = 0; k < (int)topic_of_z.size() && k < num_topics_old; k++)
+            if (k_to_new_k[k] >= 0) new_topic_of_z[k_to_new_k[k]] = topic_of_z[k];
+        topic_of_z.swap(new_topic_of_z);
     }
 
-    delete [] k_to_new_k;
-}
-
-void hdp_state::sample_tables(doc_state* d_state, double_vec & q, double_vec & f)
-{
-    vector <int*> words_by_t;
-    words_by_t.resize(d_state->m_num_tables, NULL);
-    int* p = NULL;
-    int t, word;
-    for (t = 0; t < d_state->m_num_tables; t++)
+    if (sparse_sampler() && !m_sparse_dirty)
     {
-        if (d_state->m_word_counts_by_t[t] > 0)
+        /// relabel the word-topic lists and refresh the smoothing mass. the
+        /// lists are sorted as rebuild_sparse_state() leaves them, so a run
+        /// resumed from a checkpoint visits the topics in the same order
+        for (int w = 0; w < m_size_vocab; w++)
         {
-            p = new int[d_state->m_word_counts_by_t[t]];
-            words_by_t[t] = p;
+            int_vec & topics = m_topics_by_w[w];
+            for (unsigned int j = 0; j < topics.size(); j++)
+                topics[j] = k_to_new_k[topics[j]];
+            sort(topics.begin(), topics.end());
+        }
+        m_smoothing_alias.clear();
+        m_smoothing_sum = 0.0;
+        for (k = 0; k < m_num_topics; k++)
+            m_smoothing_sum += m_smoothing_by_z[k];
+        for (k = m_num_topics; k < (int)m_smoothing_by_z.size(); k++)
+        {
+            m_smoothing_by_z[k] = 0.0;
+            m_inv_denom_by_z[k] = 1.0/(m_size_vocab * m_eta);
         }
     }
 
-    int* i_by_t = new int[d_state->m_num_tables];
-    memset(i_by_t, 0, sizeof(int) * d_state->m_num_tables);
+    for (k = 0; k < (int)m_tables_by_z.size(); k++) m_tables_by_z[k].clear();
+    m_tables_by_z.resize(m_num_topics);
 
-    for (int i = 0; i < d_state->m_doc_length; i++)
+    doc_state* d_state = NULL;
+    doc_table table;
+    for (int j = 0; j < m_num_docs; j++)
     {
-        word = d_state->m_words[i].m_word_index;
-        t    = d_state->m_words[i].m_table_assignment;
-        words_by_t[t][i_by_t[t]] =  i; // save the id for later use
-        i_by_t[t]++;
+        d_state = m_doc_states[j];
+        compact_doc_state(d_state, k_to_new_k);
+
+        table.d = j;
+        for (table.t = 0; table.t < d_state->m_num_tables; table.t++)
+            m_tables_by_z[d_state->m_table_to_topic[table.t]].push_back(table);
     }
 
-    for (t = 0; t < d_state->m_num_tables; t ++)
+    delete [] k_to_new_k;
+}
+
+void hdp_state::sample_tables(doc_state* d_state, double_vec & q, double_vec & f)
+{
+    build_word_stats(d_state);
+    const word_stats & stats = d_state->m_word_stats_by_t;
+    for (int t = 0; t < d_state->m_num_tables; t ++)
     {
         if (d_state->m_word_counts_by_t[t] > 0)
-            sample_table_assignment(d_state, t, words_by_t[t], q, f);
+            sample_table_assignment(d_state, t, stats.words(t), stats.counts(t),
+                                    stats.size(t), q, f);
         //eles no needs, since there is no data there
     }
-
-    for (t = 0; t < d_state->m_num_tables; t++)
-    {
-        p = words_by_t[t];
-        delete []p;
-    }
-    delete [] i_by_t;
 }
 
 void hdp_state::sample_table_assignment(doc_state* d_state, int t,
-                                        int * words,
+                                        const int* words, const int* counts,
+                                        int num_words,
                                         double_vec & q, double_vec & f)
 {
     //number of tables won't change at all
-    int i, w, k, m, k_old, d;
-    int* counts = new int[m_size_vocab];
-    int* counts_copy = new int[m_size_vocab];
-    memset(counts_copy, 0, sizeof(int)*m_size_vocab);
+    int w, k, m, k_old;
     int count_sum = d_state->m_word_counts_by_t[t];
-
-    for (m = 0; m < d_state->m_word_counts_by_t[t]; m ++)
-    {
-        i = words[m];
-        w = d_state->m_words[i].m_word_index;
-        counts_copy[w] ++;
-    }
-    memcpy(counts, counts_copy, sizeof(int)*m_size_vocab);
+    set_lgamma_caches();
+    lgamma_cache & lgamma_eta = m_lgamma_eta;
+    lgamma_cache & lgamma_v_eta = m_lgamma_v_eta;
 
     // compute the the log prob of being at a new cluster
-    double f_new = lgamma(m_size_vocab*m_eta) - lgamma(count_sum + m_size_vocab*m_eta);
+    double f_new = -lgamma_v_eta.diff(0, count_sum);
+    for (m = 0; m < num_words; m ++)
+        f_new += lgamma_eta.diff(0, counts[m]);
 
-    for (m = 0; m < d_state->m_word_counts_by_t[t]; m ++)
+    k_old = d_state->m_table_to_topic[t];
+    if (m_sampler == ALIAS_SAMPLER)
+        k = draw_table_topic(d_state, t, words, counts, num_words, f_new, f);
+    else
     {
-        i = words[m];
-        w = d_state->m_words[i].m_word_index;
-        if (counts[w] > 0)
-        {
-            f_new += lgamma(counts[w]+m_eta) - lgamma(m_eta);
-            counts[w] = 0;
-        }
-    }
-
-    if ((int)q.size() < m_num_topics + 1)
-        q.resize(2 * m_num_topics+1, 0.0);
+        if ((int)q.size() < m_num_topics + 1)
+            q.resize(2 * m_num_topics+1, 0.0);
 
-    if ((int)f.size() < m_num_topics)
-        f.resize(2 * m_num_topics+1, 0.0);
+        if ((int)f.size() < m_num_topics)
+            f.resize(2 * m_num_topics+1, 0.0);
 
-    q[m_num_topics] = log(m_gamma) + f_new;
+        if (can_add_topic()) q[m_num_topics] = log(m_gamma) + f_new;
+        else q[m_num_topics] = INF;
 
-    k_old = d_state->m_table_to_topic[t];
+        for (k = 0; k < m_num_topics; k ++)
+            f[k] = -lgamma_v_eta.diff(m_word_counts_by_z[k], count_sum);
+        /// the table is in k_old, so its counts are in there already
+        double f_old = lgamma_v_eta.diff(m_word_counts_by_z[k_old], -count_sum);
 
-    for (k = 0; k < m_num_topics; k ++)
-    {
-        if (k == k_old)
+        /// word by word, so each word's row of topic counts is read once
+        for (m = 0; m < num_words; m ++)
         {
-            f[k] = lgamma(m_size_vocab*m_eta + m_word_counts_by_z[k] - count_sum) -
-                   lgamma(m_size_vocab*m_eta+m_word_counts_by_z[k]);
+            const int* counts_w = m_word_counts_by_wz.row(words[m]);
+            int c = counts[m];
+            lgamma_eta.add_diff(counts_w, m_num_topics, c, &f[0]);
+            f_old -= lgamma_eta.diff(counts_w[k_old], -c);
+        }
+        f[k_old] = f_old;
 
-            memcpy(counts, counts_copy, sizeof(int)*m_size_vocab);
-            for (m = 0; m < d_state->m_word_counts_by_t[t]; m ++)
+        for (k = 0; k < m_num_topics; k ++)
+        {
+            if (k == k_old)
             {
-                i = words[m];
-                w = d_state->m_words[i].m_word_index;
-                if (counts[w] > 0)
-                {
-                    f[k] += lgamma(m_eta + m_word_counts_by_zw[k][w]) -
-                            lgamma(m_eta + m_word_counts_by_zw[k][w] - counts[w]);
-                    counts[w] = 0;
-                }
+                if (m_num_tables_by_z[k] == 1) q[k] = INF; // make it extremely small as log(0)
+                else q[k] = log(m_num_tables_by_z[k]-1) + f[k];
             }
-            if (m_num_tables_by_z[k] == 1) q[k] = INF; // make it extremely small as log(0)
-            else q[k] = log(m_num_tables_by_z[k]-1) + f[k];
+            else
+                q[k] = log(m_num_tables_by_z[k]) + f[k];
         }
-        else
+        //normalizing in log space for sampling
+        log_normalize(q, m_num_topics+1);
+        q[0] = exp(q[0]);
+        double total_q = q[0];
+        for (k = 1; k < m_num_topics+1; k++)
         {
-            f[k] = lgamma(m_size_vocab*m_eta + m_word_counts_by_z[k]) -
-                   lgamma(m_size_vocab*m_eta+m_word_counts_by_z[k] + count_sum);
-
-            memcpy(counts, counts_copy, sizeof(int)*m_size_vocab);
-            for (m = 0; m < d_state->m_word_counts_by_t[t]; m ++)
-            {
-                i = words[m];
-                w = d_state->m_words[i].m_word_index;
-                if (counts[w] > 0)
-                {
-                    f[k] += lgamma(m_eta + m_word_counts_by_zw[k][w]+counts[w]) -
-                            lgamma(m_eta + m_word_counts_by_zw[k][w]);
-                    counts[w] = 0;
-                }
-            }
-            q[k] = log(m_num_tables_by_z[k]) + f[k];
+            total_q += exp(q[k]);
+            q[k] = total_q;
         }
-    }
-    //normalizing in log space for sampling
-    log_normalize(q, m_num_topics+1);
-    q[0] = exp(q[0]);
-    double total_q = q[0];
-    for (k = 1; k < m_num_topics+1; k++)
-    {
-        total_q += exp(q[k]);
-        q[k] = total_q;
-    }
 
-    double u = runiform() * total_q;
-    for (k = 0; k < m_num_topics+1; k ++)
-        if (u < q[k]) break;
+        double u = runiform() * total_q;
+        for (k = 0; k < m_num_topics+1; k ++)
+            if (u < q[k]) break;
+    }
 
     if (k != k_old) // status doesn't change, but k could change
     {
-        d = d_state->m_doc_id;
-
         /// reassign the topic to current table
         d_state->m_table_to_topic[t] = k;
 
+        /// update the likelihood terms
+        m_topic_terms += lgamma_change(m_num_tables_by_z[k_old], -1, 0.0) +
+                         lgamma_change(m_num_tables_by_z[k], +1, 0.0);
+        m_topic_word_terms += lgamma_v_eta.diff(m_word_counts_by_z[k_old], -count_sum) +
+                              lgamma_v_eta.diff(m_word_counts_by_z[k], +count_sum);
+
         /// update the statistics by removing the table t from topic k_old
         m_num_tables_by_z[k_old] --;
-        m_word_counts_by_z[k_old]     -= count_sum;
-        m_word_counts_by_zd[k_old][d] -= count_sum;
+        m_word_counts_by_z[k_old] -= count_sum;
 
         /// update the statistics by adding the table t to topic k
         m_num_tables_by_z[k] ++;
-        m_word_counts_by_z[k]     += count_sum;
-        m_word_counts_by_zd[k][d] += count_sum;
+        m_word_counts_by_z[k] += count_sum;
 
-        for (int m = 0; m < d_state->m_word_counts_by_t[t]; m ++)
+        for (m = 0; m < num_words; m ++)
+        {
+            w = words[m];
+            if (m_base_state != NULL) touch_word(w);
+            m_word_terms += lgamma_eta.diff(m_word_counts_by_wz(w, k_old), -counts[m]) +
+                            lgamma_eta.diff(m_word_counts_by_wz(w, k), +counts[m]);
+            m_word_counts_by_wz(w, k_old) -= counts[m];
+            m_word_counts_by_wz(w, k)     += counts[m];
+            if (sparse_sampler())
+            {
+                update_sparse_word(k_old, w, -counts[m]);
+                update_sparse_word(k, w, +counts[m]);
+            }
+        }
+        if (sparse_sampler())
+        {
+            update_sparse_topic(k_old);
+            update_sparse_topic(k);
+        }
+        else
         {
-            i = words[m];
-            w = d_state->m_words[i].m_word_index;
-            m_word_counts_by_zw[k_old][w] --;
-            m_word_counts_by_zw[k][w] ++;
+            update_topic_denom(k_old);
+            update_topic_denom(k);
         }
         if (k == m_num_topics) // a new topic is created
         {
             m_num_topics ++; // create a new topic
+            m_stats.topics_born ++;
             if ((int)m_num_tables_by_z.size() < m_num_topics+1)
             {
                 m_num_tables_by_z.push_back(0);
                 m_word_counts_by_z.push_back(0);
-
-                int* p = new int [m_num_docs];
-                memset(p, 0, sizeof(int)*m_num_docs);
-                m_word_counts_by_zd.push_back(p);
-
-                p = new int [m_size_vocab];
-                memset(p, 0, sizeof(int)*m_size_vocab);
-                m_word_counts_by_zw.push_back(p);
             }
+            m_word_counts_by_wz.reserve(m_num_topics+1);
         }
     }
-    delete [] counts;
-    delete [] counts_copy;
 }
 
 void hdp_state::sample_word_assignment(doc_state* d_state, int i, bool remove, double_vec & q, double_vec & f)
 {
+    if (sparse_sampler())
+    {
+        sample_word_assignment_sparse(d_state, i, remove, q, f);
+        return;
+    }
+
     if (remove) doc_state_update(d_state, i, -1);
 
     if ((int)q.size() < d_state->m_num_tables + 1)
         q.resize(2 * d_state->m_num_tables+1, 0.0);
 
-    if ((int)f.size() < m_num_topics)
+    if ((int)f.size() < m_num_topics + 1)
         f.resize(2 * m_num_topics+1, 0.0);
+    int num_blocks = (m_num_topics + 3) / 4;
+    if ((int)m_topic_sums.size() < num_blocks + 1)
+        m_topic_sums.resize(2 * num_blocks + 1, 0.0);
 
+    /// f[k] and the sums of m_k * f[k] by blocks of topics, from 1 / (n_k + V*eta)
+    /// kept by update_topic_denom(), see topic_kernel.h
     int k, t, w;
-    w = d_state->m_words[i].m_word_index;
-    double f_new = m_gamma/m_size_vocab;
-    for (k = 0; k < m_num_topics; k++)
-    {
-        f[k] = (m_word_counts_by_zw[k][w] + m_eta)/(m_word_counts_by_z[k] + m_size_vocab * m_eta);
-        f_new += m_num_tables_by_z[k] * f[k];
-    }
-    f_new = f_new/(m_total_num_tables + m_gamma);
+    w = d_state->m_token_words[i];
+    const int* counts_w = m_word_counts_by_wz.row(w);
+    double gamma_new = can_add_topic() ? m_gamma : 0.0;
+    double* sums = &m_topic_sums[0];
+    double total_old = topic_weights(counts_w, &m_num_tables_by_z[0], &m_inv_denom_by_z[0],
+                                     m_eta, m_num_topics, &f[0], sums);
+    double f_new = (total_old + gamma_new/m_size_vocab)/(m_total_num_tables + m_gamma);
 
     double total_q = 0.0, f_k = 0.0;
     for (t = 0; t < d_state->m_num_tables; t++)
@@ -665,31 +852,122 @@ void hdp_state::sample_word_assignment(doc_state* d_state, int i, bool remove, d
         total_q += d_state->m_word_counts_by_t[t] * f_k;
         q[t] = total_q;
     }
-    total_q += m_alpha * f_new;
+    if (d_state->m_num_tables < MAX_TABLES_PER_DOC) total_q += m_alpha * f_new;
+    q[d_state->m_num_tables] = total_q;
+
+    double u = runiform() * total_q;
+    t = search_sums(&q[0], d_state->m_num_tables+1, u);
+
+    d_state->m_token_tables[i] = t; // assign the new table
+
+    if (t == d_state->m_num_tables) // this is a new table, we need get its k
+    {
+        /// the block of the topic, with the new topic as a last block of its
+        /// own, then the topic in the block
+        sums[num_blocks] = total_old + gamma_new/m_size_vocab;
+        u = runiform() * sums[num_blocks];
+        int b = search_sums(sums, gamma_new > 0.0 ? num_blocks+1 : num_blocks, u);
+        if (b == num_blocks) k = m_num_topics;
+        else
+        {
+            /// the sum of a block may round above the topics added one by
+            /// one; u is then past them, and is taken by the last topic
+            /// with tables
+            int last = b * 4 + 3 < m_num_topics ? b * 4 + 3 : m_num_topics - 1;
+            double total = b > 0 ? sums[b-1] : 0.0;
+            for (k = b * 4; k < last; k++)
+            {
+                total += m_num_tables_by_z[k] * f[k];
+                if (u < total) break;
+            }
+            while (m_num_tables_by_z[k] == 0) k--;
+        }
+        doc_state_update(d_state, i, +1, k);
+    }
+    else
+    {
+        doc_state_update(d_state, i, +1);
+    }
+}
+
+/// the same conditional as sample_word_assignment, but f_new is split into
+/// the cached smoothing bucket and a word-topic bucket over the topics in
+/// which w occurs, so only the tables of this document and the non-zero
+/// topics of w are visited per word.
+void hdp_state::sample_word_assignment_sparse(doc_state* d_state, int i, bool remove, double_vec & q, double_vec & f)
+{
+    if (remove) doc_state_update(d_state, i, -1);
+
+    if ((int)q.size() < d_state->m_num_tables + 1)
+        q.resize(2 * d_state->m_num_tables+1, 0.0);
+
+    int j, k, t, w;
+    w = d_state->m_token_words[i];
+    const int* counts_w = m_word_counts_by_wz.row(w);
+    const int_vec & topics = word_topics(w);
+    int num_topics_w = topics.size();
+
+    if ((int)f.size() < num_topics_w)
+        f.resize(2 * num_topics_w+1, 0.0);
+
+    /// word-topic bucket
+    double word_mass = 0.0;
+    for (j = 0; j < num_topics_w; j++)
+    {
+        k = topics[j];
+        f[j] = (double)m_num_tables_by_z[k] * counts_w[k] * m_inv_denom_by_z[k];
+        word_mass += f[j];
+    }
+    /// smoothing bucket, including the mass for a new topic
+    double gamma_new = can_add_topic() ? m_gamma : 0.0;
+    double smoothing_mass = m_smoothing_sum + gamma_new/m_size_vocab;
+    double f_new = (smoothing_mass + word_mass)/(m_total_num_tables + m_gamma);
+
+    /// document-table bucket
+    double total_q = 0.0;
+    for (t = 0; t < d_state->m_num_tables; t++)
+    {
+        if (d_state->m_word_counts_by_t[t] > 0)
+        {
+            k = d_state->m_table_to_topic[t];
+            total_q += d_state->m_word_counts_by_t[t] *
+                       (counts_w[k] + m_eta) * m_inv_denom_by_z[k];
+        }
+        q[t] = total_q;
+    }
+    if (d_state->m_num_tables < MAX_TABLES_PER_DOC) total_q += m_alpha * f_new;
     q[d_state->m_num_tables] = total_q;
 
     double u = runiform() * total_q;
     for (t = 0; t < d_state->m_num_tables+1; t++)
         if (u < q[t]) break;
 
-    d_state->m_words[i].m_table_assignment = t; // assign the new table
+    d_state->m_token_tables[i] = t; // assign the new table
 
     if (t == d_state->m_num_tables) // this is a new table, we need get its k
     {
-        if ((int)q.size() < m_num_topics + 1)
-            q.resize(2 * m_num_topics+1, 0.0);
-
-        total_q = 0.0;
-        for (k = 0; k < m_num_topics; k ++)
+        u = runiform() * (word_mass + smoothing_mass);
+        if (u < word_mass)
         {
-            total_q += m_num_tables_by_z[k] * f[k];
-            q[k] = total_q;
+            for (j = 0; j < num_topics_w - 1; j++)
+            {
+                u -= f[j];
+                if (u < 0) break;
+            }
+            k = topics[j];
+        }
+        else if (m_sampler == ALIAS_SAMPLER)
+            k = draw_smoothing_topic();
+        else
+        {
+            u -= word_mass;
+            for (k = 0; k < m_num_topics; k++)
+            {
+                u -= m_smoothing_by_z[k];
+                if (u < 0) break;
+            }
+            if (k == m_num_topics && !can_add_topic()) k = m_num_topics - 1; // rounding
         }
-        total_q += m_gamma/m_size_vocab;
-        q[m_num_topics] = total_q;
-        u = runiform() * total_q;
-        for (k = 0; k < m_num_topics+1; k++)
-            if (u < q[k]) break;
         doc_state_update(d_state, i, +1, k);
     }
     else
@@ -698,29 +976,315 @@ void hdp_state::sample_word_assignment(doc_state* d_state, int i, bool remove, d
     }
 }
 
+/// a topic from the smoothing bucket, m_smoothing_by_z and the new topic,
+/// by rejection from m_smoothing_alias: a topic drawn from the stale table
+/// is kept with the chance of its mass now over m_smoothing_bound times its
+/// mass in the table, so the draw is exact. the table is rebuilt once topics
+/// were added, after as many draws as it has entries, or when the masses
+/// drifted by SMOOTHING_DRIFT, so a draw costs O(1) amortised. the exact
+/// scan after SMOOTHING_TRIES rejections keeps the draw exact.
+int hdp_state::draw_smoothing_topic()
+{
+    int k, tries;
+    double gamma_new = can_add_topic() ? m_gamma : 0.0;
+    double p_new = gamma_new/m_size_vocab;
+    update_smoothing_alias();
+
+    double bound = m_smoothing_bound;
+    double weight_new = m_smoothing_alias.weight(m_num_topics);
+    if (p_new > bound * weight_new) bound = p_new / weight_new;
+    for (tries = 0; tries < SMOOTHING_TRIES; tries ++)
+    {
+        k = m_smoothing_alias.draw();
+        double p_k = k < m_num_topics ? m_smoothing_by_z[k] : p_new;
+        if (runiform() * bound * m_smoothing_alias.weight(k) < p_k) return k;
+    }
+
+    double u = runiform() * (m_smoothing_sum + gamma_new/m_size_vocab);
+    for (k = 0; k < m_num_topics; k++)
+    {
+        u -= m_smoothing_by_z[k];
+        if (u < 0) break;
+    }
+    if (k == m_num_topics && !can_add_topic()) k = m_num_topics - 1; // rounding
+    return k;
+}
+
+/// the slot of the new topic in m_smoothing_by_z is always 0, it is given
+/// the mass of a new topic for the build
+void hdp_state::update_smoothing_alias()
+{
+    if (m_smoothing_alias.size() == m_num_topics + 1 &&
+        m_smoothing_alias.m_num_draws <= m_num_topics &&
+        m_smoothing_bound <= SMOOTHING_DRIFT &&
+        (m_smoothing_sum + m_gamma/m_size_vocab) * SMOOTHING_DRIFT >= m_smoothing_alias.total()) return;
+    if ((int)m_smoothing_by_z.size() < m_num_topics + 1)
+    {
+        m_smoothing_by_z.resize(m_num_topics + 1, 0.0);
+        m_inv_denom_by_z.resize(m_num_topics + 1, 1.0/(m_size_vocab * m_eta));
+    }
+    m_smoothing_by_z[m_num_topics] = m_gamma/m_size_vocab;
+    m_smoothing_alias.build(&m_smoothing_by_z[0], m_num_topics + 1);
+    m_smoothing_by_z[m_num_topics] = 0.0;
+    m_smoothing_bound = 1.0;
+}
+
+/// log of the chance of moving the table to topic k, up to the constant
+/// sample_table_assignment() drops. a table alone in k_old can't stay, but
+/// staying is the same state as moving to a new topic, and is scored so.
+static double table_topic_log_prob(hdp_state* s, int k, int k_old, int count_sum,
+                                   const int* words, const int* counts, int num_words,
+                                   double f_new)
+{
+    int m, num_tables = s->m_num_tables_by_z[k];
+    bool alone = k == k_old && num_tables == 1;
+    if (k == s->m_num_topics)
+        return s->can_add_topic() ? log(s->m_gamma) + f_new : INF;
+    if (alone) return log(s->m_gamma) + f_new;
+    if (num_tables == 0) return INF;
+
+    double f_k;
+    if (k == k_old)
+    {
+        f_k = log(num_tables - 1) + s->m_lgamma_v_eta.diff(s->m_word_counts_by_z[k], -count_sum);
+        for (m = 0; m < num_words; m ++)
+            f_k -= s->m_lgamma_eta.diff(s->m_word_counts_by_wz(words[m], k), -counts[m]);
+    }
+    else
+    {
+        f_k = log(num_tables) - s->m_lgamma_v_eta.diff(s->m_word_counts_by_z[k], count_sum);
+        for (m = 0; m < num_words; m ++)
+            f_k += s->m_lgamma_eta.diff(s->m_word_counts_by_wz(words[m], k), counts[m]);
+    }
+    return f_k;
+}
+
+/// the word-topic bucket weight of word w in topic k, with the table, which
+/// has c of the w's and count_sum words, taken out of k_old
+static double table_word_weight(const hdp_state* s, int w, int c, int k, int k_old,
+                                int count_sum)
+{
+    if (k != k_old)
+        return (double)s->m_num_tables_by_z[k] * s->m_word_counts_by_wz(w, k) * s->m_inv_denom_by_z[k];
+    return (s->m_num_tables_by_z[k] - 1) * (s->m_word_counts_by_wz(w, k) - c) /
+           (s->m_word_counts_by_z[k] - count_sum + s->m_size_vocab * s->m_eta);
+}
+
+/// the chance draw_table_topic() proposes k: a token of the table, then the
+/// topic of a new table for its word, from the word-topic bucket or the
+/// stale smoothing bucket. the buckets leave the table out, so the chance
+/// is the same wherever the table is. word_mass holds the bucket mass of
+/// each word.
+static double table_topic_proposal(const hdp_state* s, int k, int k_old, int count_sum,
+                                   const int* words, const int* counts, int num_words,
+                                   const double* word_mass, double smoothing_mass)
+{
+    double q = 0.0, q_word;
+    double q_smoothing = smoothing_mass * s->m_smoothing_alias.prob(k);
+    if (k == k_old && s->m_num_tables_by_z[k] == 1)
+        q_smoothing += smoothing_mass * s->m_smoothing_alias.prob(s->m_num_topics);
+    for (int m = 0; m < num_words; m ++)
+    {
+        q_word = 0.0;
+        if (k < s->m_num_topics)
+            q_word = table_word_weight(s, words[m], counts[m], k, k_old, count_sum);
+        q += counts[m] * (q_word + q_smoothing) / (word_mass[m] + smoothing_mass);
+    }
+    q = (1.0 - NEW_TOPIC_PROPOSAL) * q / count_sum;
+    if (k == s->m_num_topics || (k == k_old && s->m_num_tables_by_z[k] == 1))
+        q += NEW_TOPIC_PROPOSAL;
+    return q;
+}
+
+/// the topic of table t by metropolis-hastings, starting from its topic, as
+/// the exact scan in sample_table_assignment() costs O(K) per word of the
+/// table. a proposal costs O(1) per distinct word of the table once the
+/// word-topic buckets of its words are summed.
+int hdp_state::draw_table_topic(doc_state* d_state, int t,
+                                const int* words, const int* counts, int num_words,
+                                double f_new, double_vec & f)
+{
+    int k_old = d_state->m_table_to_topic[t];
+    int count_sum = d_state->m_word_counts_by_t[t];
+    bool alone = m_num_tables_by_z[k_old] == 1;
+    int j, k, m, step;
+    double u;
+
+    /// the buckets without the table
+    update_smoothing_alias();
+    double smoothing_mass = m_smoothing_sum - m_smoothing_by_z[k_old] + m_gamma/m_size_vocab +
+                            (m_num_tables_by_z[k_old] - 1) * m_eta /
+                            (m_word_counts_by_z[k_old] - count_sum + m_size_vocab * m_eta);
+    if ((int)f.size() < num_words)
+        f.resize(2 * num_words+1, 0.0);
+    for (m = 0; m < num_words; m ++)
+    {
+        const int_vec & topics = word_topics(words[m]);
+        f[m] = 0.0;
+        for (j = 0; j < (int)topics.size(); j++)
+            f[m] += table_word_weight(this, words[m], counts[m], topics[j], k_old, count_sum);
+    }
+
+    k = k_old;
+    double log_p_k = table_topic_log_prob(this, k, k_old, count_sum, words, counts,
+                                          num_words, f_new);
+    double q_k = table_topic_proposal(this, k, k_old, count_sum, words, counts,
+                                      num_words, &f[0], smoothing_mass);
+    for (step = 0; step < TABLE_MH_STEPS; step ++)
+    {
+        /// a new topic, or a token of the table, then a topic for its word
+        if (runiform() < NEW_TOPIC_PROPOSAL)
+            j = m_num_topics;
+        else
+        {
+            u = runiform() * count_sum;
+            for (m = 0; m < num_words - 1; m ++)
+            {
+                u -= counts[m];
+                if (u < 0) break;
+            }
+            u = runiform() * (f[m] + smoothing_mass);
+            if (u < f[m])
+            {
+                const int_vec & topics = word_topics(words[m]);
+                for (j = 0; j < (int)topics.size() - 1; j++)
+                {
+                    u -= table_word_weight(this, words[m], counts[m], topics[j], k_old, count_sum);
+                    if (u < 0) break;
+                }
+                j = topics[j];
+            }
+            else
+                j = m_smoothing_alias.draw();
+        }
+        if (alone && j == m_num_topics) j = k_old;
+        if (j == k) continue;
+
+        double log_p_j = table_topic_log_prob(this, j, k_old, count_sum, words, counts,
+                                              num_words, f_new);
+        double q_j = table_topic_proposal(this, j, k_old, count_sum, words, counts,
+                                          num_words, &f[0], smoothing_mass);
+        if (log(runiform()) < log_p_j - log_p_k + log(q_k) - log(q_j))
+        {
+            k = j;
+            log_p_k = log_p_j;
+            q_k = q_j;
+        }
+    }
+    return k;
+}
+
+void hdp_state::rebuild_sparse_state()
+{
+    int size = m_num_tables_by_z.size();
+    m_smoothing_by_z.assign(size, 0.0);
+    m_inv_denom_by_z.assign(size, 1.0/(m_size_vocab * m_eta));
+    m_smoothing_sum = 0.0;
+    for (int k = 0; k < m_num_topics; k++)
+        update_sparse_topic(k);
+
+    m_topics_by_w.clear();
+    m_topics_by_w.resize(m_size_vocab, int_vec());
+    for (int w = 0; w < m_size_vocab; w++)
+    {
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        for (int k = 0; k < m_num_topics; k++)
+            if (counts_w[k] > 0) m_topics_by_w[w].push_back(k);
+    }
+    m_smoothing_alias.clear();
+    m_sparse_dirty = false;
+}
+
+// called after m_num_tables_by_z[k] or m_word_counts_by_z[k] changed
+void hdp_state::update_sparse_topic(int k)
+{
+    if ((int)m_smoothing_by_z.size() < (int)m_num_tables_by_z.size())
+    {
+        m_smoothing_by_z.resize(m_num_tables_by_z.size(), 0.0);
+        m_inv_denom_by_z.resize(m_num_tables_by_z.size(), 1.0/(m_size_vocab * m_eta));
+    }
+    double inv_denom = 1.0/(m_word_counts_by_z[k] + m_size_vocab * m_eta);
+    double smoothing = m_num_tables_by_z[k] * m_eta * inv_denom;
+    m_smoothing_sum += smoothing - m_smoothing_by_z[k];
+    m_smoothing_by_z[k] = smoothing;
+    m_inv_denom_by_z[k] = inv_denom;
+
+    /// the bound for the smoothing table of ALIAS_SAMPLER, whose last entry
+    /// is the new topic
+    if (k < m_smoothing_alias.size() - 1)
+    {
+        double weight = m_smoothing_alias.weight(k);
+        if (smoothing > m_smoothing_bound * weight)
+            m_smoothing_bound = weight > 0.0 ? smoothing / weight : HUGE_VAL;
+    }
+}
+
+/// the dense sampler's 1 / (n_k + V*eta), for the counts as the sweep starts,
+/// then kept by update_topic_denom() as they change
+void hdp_state::rebuild_topic_denoms()
+{
+    m_inv_denom_by_z.resize(m_num_tables_by_z.size(), 1.0/(m_size_vocab * m_eta));
+    for (int k = 0; k < m_num_topics; k++)
+        update_topic_denom(k);
+}
+
+// called after m_word_counts_by_z[k] changed, by the dense sampler
+void hdp_state::update_topic_denom(int k)
+{
+    if ((int)m_inv_denom_by_z.size() < (int)m_num_tables_by_z.size())
+        m_inv_denom_by_z.resize(m_num_tables_by_z.size(), 1.0/(m_size_vocab * m_eta));
+    m_inv_denom_by_z[k] = 1.0/(m_word_counts_by_z[k] + m_size_vocab * m_eta);
+}
+
+// called after m_word_counts_by_wz(w, k) changed by update
+void hdp_state::update_sparse_word(int k, int w, int update)
+{
+    int count = m_word_counts_by_wz(w, k);
+    int_vec & topics = m_topics_by_w[w];
+    if (update > 0 && count == update) // k becomes non-zero for w
+        topics.push_back(k);
+    else if (update < 0 && count == 0)  // k becomes zero for w
+    {
+        for (unsigned int j = 0; j < topics.size(); j++)
+        {
+            if (topics[j] == k)
+            {
+                topics[j] = topics.back();
+                topics.pop_back();
+                break;
+            }
+        }
+    }
+}
+
 // k is only provided when m_table_to_topic doesn't have that
 void hdp_state::doc_state_update(doc_state* d_state, int i, int update, int k)
 {
-    int d, w, t;
-    d = d_state->m_doc_id;
-    w = d_state->m_words[i].m_word_index;
-    //k = d_state->m_words[i].m_topic_assignment;
-    t = d_state->m_words[i].m_table_assignment;
+    int w, t;
+    w = d_state->m_token_words[i];
+    t = d_state->m_token_tables[i];
     if (k < 0) k = d_state->m_table_to_topic[t];
     assert(k >= 0);
 
 
+    if (m_base_state != NULL) touch_word(w);
+    m_table_terms      += lgamma_change(d_state->m_word_counts_by_t[t], update, 0.0);
+    m_topic_word_terms += lgamma_change(m_word_counts_by_z[k], update, m_size_vocab * m_eta);
+    m_word_terms       += lgamma_change(m_word_counts_by_wz(w, k), update, m_eta);
+
     d_state->m_word_counts_by_t[t] += update;
 
     m_word_counts_by_z[k]          += update;
-    m_word_counts_by_zw[k][w]      += update;
-    m_word_counts_by_zd[k][d]      += update;
+    m_word_counts_by_wz(w, k)      += update;
+    if (sparse_sampler()) update_sparse_word(k, w, update);
 
     if (update == -1 && d_state->m_word_counts_by_t[t] == 0) /// this table becomes empty
     {
+        m_topic_terms += lgamma_change(m_num_tables_by_z[k], -1, 0.0);
         m_total_num_tables --;
         m_num_tables_by_z[k] --;
         d_state->m_table_to_topic[t] = -1;
+        m_stats.tables_destroyed ++;
         /// m_num_topics, no need to change at this moment
     }
 
@@ -729,8 +1293,10 @@ void hdp_state::doc_state_update(doc_state* d_state, int i, int update, int k)
         if (t == d_state->m_num_tables) d_state->m_num_tables ++; // create a new table
         d_state->m_table_to_topic[t] = k; // mapping the table
 
+        m_topic_terms += lgamma_change(m_num_tables_by_z[k], +1, 0.0);
         m_num_tables_by_z[k] ++;          // adding the table to mixture k
         m_total_num_tables ++;
+        m_stats.tables_created ++;
 
         if ((int)d_state->m_table_to_topic.size() < d_state->m_num_tables+1)
         {
@@ -741,21 +1307,17 @@ void hdp_state::doc_state_update(doc_state* d_state, int i, int update, int k)
         {
             assert(m_word_counts_by_z[k] == 1);
             if (k == m_num_topics) m_num_topics ++; // create a new topic
+            m_stats.topics_born ++;
             if ((int)m_num_tables_by_z.size() < m_num_topics+1)
             {
                 m_num_tables_by_z.push_back(0);
                 m_word_counts_by_z.push_back(0);
-
-                int* p = new int [m_num_docs];
-                memset(p, 0, sizeof(int)*m_num_docs);
-                m_word_counts_by_zd.push_back(p);
-
-                p = new int [m_size_vocab];
-                memset(p, 0, sizeof(int)*m_size_vocab);
-                m_word_counts_by_zw.push_back(p);
             }
+            m_word_counts_by_wz.reserve(m_num_topics+1);
         }
     }
+    if (sparse_sampler()) update_sparse_topic(k);
+    else update_topic_denom(k);
 }
 
 double hdp_state::doc_partition_likelihood(doc_state* d_state)
@@ -784,32 +1346,46 @@ double hdp_state::table_partition_likelihood()
 
 double hdp_state::data_likelihood()
 {
-    double likelihood = m_num_topics * lgamma(m_size_vocab * m_eta);
-    double lgamma_eta = lgamma(m_eta);
+    set_lgamma_caches();
+    double likelihood = 0.0;
 
     for (int k = 0; k < m_num_topics; k++)
     {
-        likelihood -= lgamma(m_size_vocab * m_eta + m_word_counts_by_z[k]);
-        for (int w = 0; w < m_size_vocab; w++)
-        {
-            if (m_word_counts_by_zw[k][w]>0)
-            {
-                likelihood += lgamma(m_word_counts_by_zw[k][w] + m_eta) - lgamma_eta;
-            }
-        }
+        likelihood -= m_lgamma_v_eta.diff(0, m_word_counts_by_z[k]);
+    }
+    for (int w = 0; w < m_size_vocab; w++)
+    {
+        likelihood += word_terms(w);
     }
     return likelihood;
 }
 
+/// the same as the sum of doc_partition_likelihood() over the documents,
+/// table_partition_likelihood() and data_likelihood(), but with the terms
+/// that depend on the counts kept up to date by the updates, so only the
+/// O(D) terms of alpha and gamma are computed here.
 double hdp_state::joint_likelihood(hdp_hyperparameter * hdp_hyperparam)
 {
-    double likelihood = 0.0;
+    if (m_likelihood_dirty)
+        compute_likelihood_terms();
+    else if (++m_num_likelihoods == LIKELIHOOD_CHECK_LAG)
+    {
+        /// check the running sums against the counts
+        double terms = m_table_terms + m_topic_terms - m_topic_word_terms + m_word_terms;
+        compute_likelihood_terms();
+        double exact = m_table_terms + m_topic_terms - m_topic_word_terms + m_word_terms;
+        if (fabs(terms - exact) > 1e-6 * fabs(exact))
+            fprintf(m_log, "likelihood terms drifted by %g, recomputed.\n", terms - exact);
+    }
+
+    double likelihood = m_total_num_tables * log(m_alpha) + m_table_terms;
     for (int d = 0; d < m_num_docs; d++)
     {
-        likelihood += doc_partition_likelihood(m_doc_states[d]);
+        likelihood -= log_factorial(m_doc_states[d]->m_doc_length, m_alpha);
     }
-    likelihood += table_partition_likelihood();
-    likelihood += data_likelihood();
+    likelihood += m_num_topics * log(m_gamma) + m_topic_terms
+                - log_factorial(m_total_num_tables, m_gamma);
+    likelihood += m_word_terms - m_topic_word_terms;
 
     if (hdp_hyperparam->m_sample_hyperparameter) // counting the likelihood for gamma and alpha
     {
@@ -825,8 +1401,56 @@ double hdp_state::joint_likelihood(hdp_hyperparameter * hdp_hyperparam)
     return likelihood;
 }
 
+void hdp_state::compute_likelihood_terms()
+{
+    m_table_terms = 0.0;
+    for (int d = 0; d < m_num_docs; d++)
+    {
+        doc_state* d_state = m_doc_states[d];
+        for (int t = 0; t < d_state->m_num_tables; t++)
+            if (d_state->m_word_counts_by_t[t] > 0)
+                m_table_terms += lgamma(d_state->m_word_counts_by_t[t]);
+    }
+    compute_topic_terms();
+
+    m_word_terms = 0.0;
+    for (int w = 0; w < m_size_vocab; w++)
+        m_word_terms += word_terms(w);
+
+    m_likelihood_dirty = false;
+    m_num_likelihoods = 0;
+}
+
+void hdp_state::compute_topic_terms()
+{
+    set_lgamma_caches();
+    m_topic_terms = 0.0;
+    m_topic_word_terms = 0.0;
+    for (int k = 0; k < m_num_topics; k++)
+    {
+        if (m_num_tables_by_z[k] > 0) m_topic_terms += lgamma(m_num_tables_by_z[k]);
+        m_topic_word_terms += m_lgamma_v_eta.diff(0, m_word_counts_by_z[k]);
+    }
+}
+
+/// sum over the topics of lgamma(n_wk + eta) - lgamma(eta) for word w
+double hdp_state::word_terms(int w) const
+{
+    set_lgamma_caches();
+    double terms = 0.0;
+    const int* counts_w = m_word_counts_by_wz.row(w);
+    for (int k = 0; k < m_num_topics; k++)
+        if (counts_w[k] > 0) terms += m_lgamma_eta.diff(0, counts_w[k]);
+    return terms;
+}
+
 void  hdp_state::save_state(char * name)
 {
+    if (m_output_format == BINARY_OUTPUT)
+    {
+        save_state_bin(name);
+        return;
+    }
     char filename[500];
 
     // save the topic words counts
@@ -836,7 +1460,7 @@ void  hdp_state::save_state(char * name)
     for (int k = 0; k < m_num_topics; k ++)
     {
         for (int w = 0; w < m_size_vocab; w ++)
-            fprintf(file, "%05d ", m_word_counts_by_zw[k][w]);
+            fprintf(file, "%05d ", m_word_counts_by_wz(w, k));
         fprintf(file, "\n");
     }
     fclose(file);
@@ -851,61 +1475,340 @@ void  hdp_state::save_state(char * name)
         int doc_id = d_state->m_doc_id;
         for (int i = 0; i < d_state->m_doc_length; i++)
         {
-            w = d_state->m_words[i].m_word_index;
-            t = d_state->m_words[i].m_table_assignment;
+            w = d_state->m_token_words[i];
+            t = d_state->m_token_tables[i];
             k = d_state->m_table_to_topic[t];
             fprintf(file, "%d %d %d %d\n",
                     doc_id, w, k, t);
         }
     }
     fclose(file);
+
+    sprintf(filename, "%s-topics.dat", name);
+    m_stats.bytes_written += file_size(filename);
+    sprintf(filename, "%s-word-assignments.dat", name);
+    m_stats.bytes_written += file_size(filename);
 }
 
-void hdp_state::save_state_ex(char * name)
+/// the same counts and assignments as save_state(), as the sparse binary
+/// files described in output.h
+void hdp_state::save_state_bin(char * name)
 {
-    FILE * file = fopen(name, "wb");
-    fwrite(&m_size_vocab, sizeof(int), 1, file);
-    fwrite(&m_total_words, sizeof(int), 1, file);
-    fwrite(&m_num_topics, sizeof(int), 1, file);
-    fwrite(&m_total_num_tables, sizeof(int), 1, file);
+    char filename[500];
+    int w, k, d, i;
 
-    fwrite(&m_eta, sizeof(double), 1, file);
-    fwrite(&m_gamma, sizeof(double), 1, file);
-    fwrite(&m_alpha, sizeof(double), 1, file);
-    
-    for(int k = 0; k < m_num_topics; k ++)
+    topic_counts topics;
+    topics.size_vocab = m_size_vocab;
+    topics.offsets.assign(m_num_topics + 1, 0);
+    for (w = 0; w < m_size_vocab; w++)
     {
-        fwrite(&(m_num_tables_by_z[k]), sizeof(int), 1, file);
-        fwrite(&(m_word_counts_by_z[k]), sizeof(int), 1, file);
-        fwrite(m_word_counts_by_zw[k], sizeof(int), m_size_vocab, file);
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        for (k = 0; k < m_num_topics; k++)
+            if (counts_w[k] > 0) topics.offsets[k + 1]++;
     }
-    fclose(file);
+    for (k = 0; k < m_num_topics; k++)
+        topics.offsets[k + 1] += topics.offsets[k];
+
+    /// the words come in increasing order, each topic fills its own range
+    vector <int64_t> next(topics.offsets.begin(), topics.offsets.end() - 1);
+    topics.words.resize(topics.offsets[m_num_topics]);
+    topics.counts.resize(topics.offsets[m_num_topics]);
+    for (w = 0; w < m_size_vocab; w++)
+    {
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        for (k = 0; k < m_num_topics; k++)
+            if (counts_w[k] > 0)
+            {
+                topics.words[next[k]] = w;
+                topics.counts[next[k]++] = counts_w[k];
+            }
+    }
+    sprintf(filename, "%s-topics.bin", name);
+    topics.write(filename);
+    m_stats.bytes_written += file_size(filename);
+
+    /// the documents by id, whatever order the sampler keeps them in
+    vector <doc_state*> docs(m_num_docs);
+    for (d = 0; d < m_num_docs; d++)
+        docs[m_doc_states[d]->m_doc_id] = m_doc_states[d];
+
+    word_assignments assignments;
+    assignments.size_vocab = m_size_vocab;
+    assignments.offsets.assign(1, 0);
+    assignments.words.reserve(m_total_words);
+    assignments.topics.reserve(m_total_words);
+    assignments.tables.reserve(m_total_words);
+    for (d = 0; d < m_num_docs; d++)
+    {
+        doc_state* d_state = docs[d];
+        for (i = 0; i < d_state->m_doc_length; i++)
+        {
+            int t = d_state->m_token_tables[i];
+            assignments.words.push_back(d_state->m_token_words[i]);
+            assignments.topics.push_back(d_state->m_table_to_topic[t]);
+            assignments.tables.push_back(t);
+        }
+        assignments.offsets.push_back(assignments.words.size());
+    }
+    sprintf(filename, "%s-word-assignments.bin", name);
+    assignments.write(filename);
+    m_stats.bytes_written += file_size(filename);
 }
 
+void hdp_state::save_state_ex(char * name)
+{
+    write_model(name, NULL, NULL);
+}
+
+/// the topics of a saved model, to sample new documents against
 void hdp_state::load_state_ex(char * name)
 {
-    FILE * file = fopen(name, "rb");
-    fread(&m_size_vocab, sizeof(int), 1, file);
-    fread(&m_total_words, sizeof(int), 1, file);
-    fread(&m_num_topics, sizeof(int), 1, file);
-    fread(&m_total_num_tables, sizeof(int), 1, file);
+    model_file model;
+    if (!model.map(name))
+    {
+        printf("%s is not a model of version %d.\n", name, MODEL_VERSION);
+        exit(1);
+    }
+    const model_header * header = model.header;
+    m_size_vocab = header->size_vocab;
+    m_total_words = header->total_words;
+    m_num_topics = header->num_topics;
+    m_total_num_tables = header->total_num_tables;
+
+    m_eta = header->eta;
+    m_gamma = header->gamma;
+    m_alpha = header->alpha;
+
+    m_num_tables_by_z.assign(model.tables_by_z, model.tables_by_z + m_num_topics);
+    m_word_counts_by_z.assign(model.words_by_z, model.words_by_z + m_num_topics);
+    m_word_counts_by_wz.allocate(m_size_vocab, m_num_topics + 1);
+    for (int w = 0; w < m_size_vocab; w++)
+        memcpy(m_word_counts_by_wz.row(w), model.word_counts + (size_t)w * m_num_topics,
+               sizeof(int) * m_num_topics);
+    m_likelihood_dirty = true;
+}
 
-    fread(&m_eta, sizeof(double), 1, file);
-    fread(&m_gamma, sizeof(double), 1, file);
-    fread(&m_alpha, sizeof(double), 1, file);
+/// write to a temporary file first, a run stopped while writing keeps the
+/// checkpoint before
+void hdp_state::save_checkpoint(char * name, const hdp_hyperparameter * hdp_param,
+                                const run_state * run)
+{
+    char temp[1000];
+    sprintf(temp, "%s.tmp", name);
+    write_model(temp, hdp_param, run);
+    if (rename(temp, name) != 0)
+    {
+        printf("can't write %s.\n", name);
+        exit(1);
+    }
+}
 
-    m_num_tables_by_z.resize(m_num_topics);
-    m_word_counts_by_z.resize(m_num_topics);
-    m_word_counts_by_zw.resize(m_num_topics);
-    for(int k = 0; k < m_num_topics; k ++)
+/// a checkpoint is a model with the documents of the state, the priors and
+/// where the run is, see model.h
+void hdp_state::write_model(const char * name, const hdp_hyperparameter * hdp_param,
+                            const run_state * run)
+{
+    model_writer out;
+    out.open(name);
+    model_header & header = out.header;
+    header.size_vocab = m_size_vocab;
+    header.num_topics = m_num_topics;
+    header.num_docs = (run != NULL) ? m_num_docs : 0;
+    header.total_num_tables = m_total_num_tables;
+    header.total_words = m_total_words;
+    header.eta = m_eta;
+    header.gamma = m_gamma;
+    header.alpha = m_alpha;
+    if (hdp_param != NULL)
+    {
+        header.gamma_a = hdp_param->m_gamma_a;
+        header.gamma_b = hdp_param->m_gamma_b;
+        header.alpha_a = hdp_param->m_alpha_a;
+        header.alpha_b = hdp_param->m_alpha_b;
+        header.sample_hyperparameter = hdp_param->m_sample_hyperparameter;
+        header.split_merge_sampler = hdp_param->m_split_merge_sampler;
+        header.sampler = hdp_param->m_sampler;
+        header.num_restricted_scans = hdp_param->m_num_restricted_scans;
+    }
+    if (run != NULL)
+    {
+        header.iteration = run->iteration;
+        header.num_moves = run->num_moves;
+        header.num_accepted = run->num_accepted;
+        header.seed = run->seed;
+        header.best_likelihood = run->best_likelihood;
+        header.num_history = run->likelihoods.size();
+    }
+
+    header.topics_offset = out.offset();
+    if (m_num_topics > 0)
+    {
+        out.write(&m_num_tables_by_z[0], sizeof(int) * m_num_topics);
+        out.write(&m_word_counts_by_z[0], sizeof(int) * m_num_topics);
+    }
+    out.align(MODEL_PAGE_SIZE);
+    header.word_counts_offset = out.offset();
+    for (int w = 0; w < m_size_vocab; w++)
+        out.write(m_word_counts_by_wz.row(w), sizeof(int) * m_num_topics);
+
+    if (run != NULL)
+    {
+        out.align(8);
+        header.docs_offset = out.offset();
+        int d;
+        for (d = 0; d < m_num_docs; d++)
+            out.write(&m_doc_states[d]->m_doc_id, sizeof(int));
+        out.align(8);
+        int64_t offset = 0;
+        out.write(&offset, sizeof(offset));
+        for (d = 0; d < m_num_docs; d++)
+        {
+            offset += m_doc_states[d]->m_num_tables;
+            out.write(&offset, sizeof(offset));
+        }
+        offset = 0;
+        out.write(&offset, sizeof(offset));
+        for (d = 0; d < m_num_docs; d++)
+        {
+            offset += m_doc_states[d]->m_doc_length;
+            out.write(&offset, sizeof(offset));
+        }
+        for (d = 0; d < m_num_docs; d++)
+            out.write(&m_doc_states[d]->m_table_to_topic[0], sizeof(int) * m_doc_states[d]->m_num_tables);
+        out.align(8);
+        int_vec tokens;
+        for (d = 0; d < m_num_docs; d++)
+        {
+            const doc_state* d_state = m_doc_states[d];
+            tokens.resize(2 * d_state->m_doc_length);
+            for (int i = 0; i < d_state->m_doc_length; i++)
+            {
+                tokens[2*i] = d_state->m_token_words[i];
+                tokens[2*i+1] = d_state->m_token_tables[i];
+            }
+            out.write(tokens.empty() ? NULL : &tokens[0], sizeof(int) * tokens.size());
+        }
+        if (header.num_history > 0)
+        {
+            out.write(&run->likelihoods[0], sizeof(double) * header.num_history);
+            out.write(&run->num_topics[0], sizeof(int32_t) * header.num_history);
+            out.align(8);
+        }
+    }
+    out.close();
+    m_stats.bytes_written += file_size(name);
+}
+
+/// restore a state set up from the corpus the checkpoint was trained on. the
+/// assignments are added back one token at a time, which rebuilds the counts,
+/// and the counts saved are kept to check them against.
+void hdp_state::load_checkpoint(char * name, hdp_hyperparameter * hdp_param,
+                                run_state * run)
+{
+    model_file model;
+    if (!model.map(name) || model.header->num_docs == 0)
+    {
+        printf("%s is not a checkpoint of version %d.\n", name, MODEL_VERSION);
+        exit(1);
+    }
+    const model_header * header = model.header;
+    if (header->num_docs != m_num_docs || header->total_words != m_total_words ||
+        header->size_vocab != m_size_vocab)
+    {
+        printf("%s is a checkpoint of other data.\n", name);
+        exit(1);
+    }
+
+    m_eta = header->eta;
+    m_gamma = header->gamma;
+    m_alpha = header->alpha;
+    hdp_param->m_gamma_a = header->gamma_a;
+    hdp_param->m_gamma_b = header->gamma_b;
+    hdp_param->m_alpha_a = header->alpha_a;
+    hdp_param->m_alpha_b = header->alpha_b;
+    hdp_param->m_sample_hyperparameter = header->sample_hyperparameter != 0;
+    hdp_param->m_split_merge_sampler = header->split_merge_sampler != 0;
+    hdp_param->m_sampler = m_sampler = header->sampler;
+    hdp_param->m_num_restricted_scans = header->num_restricted_scans;
+    run->iteration = header->iteration;
+    run->num_moves = header->num_moves;
+    run->num_accepted = header->num_accepted;
+    run->seed = header->seed;
+    run->best_likelihood = header->best_likelihood;
+    run->likelihoods.assign(model.history_likelihoods,
+                            model.history_likelihoods + header->num_history);
+    run->num_topics.assign(model.history_topics, model.history_topics + header->num_history);
+
+    /// room for the topics, as the sampler would have made it
+    int num_topics = header->num_topics;
+    while ((int)m_num_tables_by_z.size() < num_topics + 1)
+    {
+        m_num_tables_by_z.push_back(0);
+        m_word_counts_by_z.push_back(0);
+    }
+    m_word_counts_by_wz.reserve(num_topics + 1);
+    m_num_topics = num_topics;
+
+    /// the documents go back in the order they were visited in, the sparse
+    /// caches are rebuilt from the counts by the next sweep
+    vector <doc_state*> docs_by_id(m_num_docs, (doc_state*)NULL);
+    for (int d = 0; d < m_num_docs; d++)
+        docs_by_id[m_doc_states[d]->m_doc_id] = m_doc_states[d];
+    int sampler = m_sampler;
+    m_sampler = DENSE_SAMPLER;
+    bool ok = true;
+    for (int j = 0; ok && j < m_num_docs; j++)
+    {
+        int id = model.doc_ids[j];
+        ok = id >= 0 && id < m_num_docs && docs_by_id[id] != NULL;
+        if (!ok) break;
+        doc_state* d_state = docs_by_id[id];
+        docs_by_id[id] = NULL;
+        m_doc_states[j] = d_state;
+
+        int num_tables = model.table_offsets[j+1] - model.table_offsets[j];
+        const int* table_topics = model.table_topics + model.table_offsets[j];
+        const int* tokens = model.tokens + 2 * model.token_offsets[j];
+        ok = model.token_offsets[j+1] - model.token_offsets[j] == d_state->m_doc_length &&
+             num_tables <= MAX_TABLES_PER_DOC;
+
+        d_state->m_num_tables = num_tables;
+        d_state->m_table_to_topic.assign(num_tables + 1, -1);
+        d_state->m_word_counts_by_t.assign(num_tables + 1, 0);
+        for (int i = 0; ok && i < d_state->m_doc_length; i++)
+        {
+            int w = tokens[2*i], t = tokens[2*i+1];
+            ok = w >= 0 && w < m_size_vocab && t >= 0 && t < num_tables &&
+                 table_topics[t] >= 0 && table_topics[t] < num_topics;
+            if (!ok) break;
+            d_state->m_token_words[i] = w;
+            d_state->m_token_tables[i] = t;
+            doc_state_update(d_state, i, +1, table_topics[t]);
+        }
+        for (int t = 0; ok && t < num_tables; t++)
+            ok = d_state->m_table_to_topic[t] == table_topics[t];
+    }
+    m_sampler = sampler;
+    m_sparse_dirty = true;
+    m_likelihood_dirty = true;
+
+    for (int k = 0; ok && k < num_topics; k++)
+        ok = m_num_tables_by_z[k] == model.tables_by_z[k] &&
+             m_word_counts_by_z[k] == model.words_by_z[k];
+    if (!ok || m_total_num_tables != header->total_num_tables)
     {
-        fread(&(m_num_tables_by_z[k]), sizeof(int), 1, file);
-        fread(&(m_word_counts_by_z[k]), sizeof(int), 1, file);
+        printf("%s doesn't match its data.\n", name);
+        exit(1);
+    }
 
-        m_word_counts_by_zw[k] = new int [m_size_vocab];
-        fread(m_word_counts_by_zw[k], sizeof(int), m_size_vocab, file);
+    m_tables_by_z.resize(m_num_topics);
+    doc_table table;
+    for (int j = 0; j < m_num_docs; j++)
+    {
+        table.d = j;
+        for (table.t = 0; table.t < m_doc_states[j]->m_num_tables; table.t++)
+            m_tables_by_z[m_doc_states[j]->m_table_to_topic[table.t]].push_back(table);
     }
-    fclose(file);
 }
 
 bool hdp_state::state_check_sum()
@@ -921,14 +1824,17 @@ bool hdp_state::state_check_sum()
         printf("\ntotal words does not match\n");
         status_OK = false;
     }
+    int_vec sum_by_z(m_num_topics, 0);
+    int_vec topics, counts;
+    for (int d = 0; d < m_num_docs; d ++)
+    {
+        m_doc_states[d]->topic_counts(topics, counts);
+        for (unsigned int j = 0; j < topics.size(); j ++)
+            sum_by_z[topics[j]] += counts[j];
+    }
     for (int k = 0; k < m_num_topics; k ++)
     {
-        sum = 0;
-        for (int d = 0; d < m_num_docs; d ++)
-        {
-            sum += m_word_counts_by_zd[k][d];
-        }
-        if (sum != m_word_counts_by_z[k])
+        if (sum_by_z[k] != m_word_counts_by_z[k])
         {
             printf("\nin topic %d, total words does not match\n", k);
             status_OK = false;
@@ -936,7 +1842,7 @@ bool hdp_state::state_check_sum()
         sum = 0;
         for (int w = 0; w < m_size_vocab; w ++)
         {
-            sum += m_word_counts_by_zw[k][w];
+            sum += m_word_counts_by_wz(w, k);
         }
         if (sum != m_word_counts_by_z[k])
         {
@@ -981,7 +1887,7 @@ void hdp_state::sample_first_level_concentration(hdp_hyperparameter* hdp_hyperpa
     else
         m_gamma = rgamma(shape + k - 1, 1.0 / rate);
 
-    if (VERBOSE) printf("gamma=%f, ", m_gamma);
+    if (VERBOSE) fprintf(m_log, "gamma=%f, ", m_gamma);
 
 }
 void hdp_state::sample_second_level_concentration(hdp_hyperparameter* hdp_hyperparam)
@@ -1004,60 +1910,185 @@ void hdp_state::sample_second_level_concentration(hdp_hyperparameter* hdp_hyperp
         rate = 1.0 / scale - sum_log_w;
         m_alpha = rgamma(shape + n - sum_s, 1.0 / rate);
     }
-    if (VERBOSE) printf("alpha=%f, ", m_alpha);
+    if (VERBOSE) fprintf(m_log, "alpha=%f, ", m_alpha);
 }
 
-void hdp_state::copy_state(const hdp_state* state)
+/// set up proposal p to read this state, see m_proposals. it only copies the
+/// topic vectors, the row and document pointers; split_sampling() and
+/// merge_two_topics() copy the rows and the documents they write.
+hdp_state* hdp_state::setup_proposal(int p)
 {
-    m_eta   = state->m_eta;
-    m_gamma = state->m_gamma;
-    m_alpha = state->m_alpha;
-    m_size_vocab  = state->m_size_vocab;
-    m_total_words = state->m_total_words;
-    m_num_docs    = state->m_num_docs;
+    while ((int)m_proposals.size() <= p)
+        m_proposals.push_back(new hdp_state());
+    hdp_state* proposal = m_proposals[p];
+
+    /// a split adds a topic, the proposal can't widen the rows it shares
+    m_word_counts_by_wz.reserve(m_num_topics + 2);
+
+    proposal->m_base_state = this;
+    proposal->m_eta   = m_eta;
+    proposal->m_gamma = m_gamma;
+    proposal->m_alpha = m_alpha;
+    proposal->m_size_vocab  = m_size_vocab;
+    proposal->m_total_words = m_total_words;
+    proposal->m_sampler = m_sampler;
+    proposal->m_sparse_dirty = true; // proposals don't keep the sparse caches
+
+    proposal->m_num_topics       = m_num_topics;
+    proposal->m_base_num_topics  = m_num_topics;
+    proposal->m_total_num_tables = m_total_num_tables;
+    proposal->m_num_tables_by_z  = m_num_tables_by_z;
+    proposal->m_word_counts_by_z = m_word_counts_by_z;
+    proposal->m_word_counts_by_wz.overlay(&m_word_counts_by_wz);
+
+    proposal->free_private_docs();
+    if (proposal->m_num_docs != m_num_docs)
+    {
+        delete [] proposal->m_doc_states;
+        proposal->m_doc_states = new doc_state* [m_num_docs];
+        proposal->m_num_docs = m_num_docs;
+    }
+    memcpy(proposal->m_doc_states, m_doc_states, sizeof(doc_state*)*m_num_docs);
+
+    /// only the changes are added back
+    proposal->m_table_terms = proposal->m_topic_terms = 0.0;
+    proposal->m_topic_word_terms = proposal->m_word_terms = 0.0;
+    proposal->m_likelihood_dirty = false;
+    return proposal;
+}
 
-    m_num_topics       = state->m_num_topics;
-    m_total_num_tables = state->m_total_num_tables;
+/// copy document d of the base state before a proposal changes its tables
+doc_state* hdp_state::touch_doc(int d)
+{
+    doc_state* src_d_state = m_doc_states[d];
+    if (m_base_state == NULL || src_d_state != m_base_state->m_doc_states[d])
+        return src_d_state;
+
+    doc_state* d_state = new doc_state();
+    d_state->m_doc_id     = src_d_state->m_doc_id;
+    d_state->m_doc_length = src_d_state->m_doc_length;
+    d_state->m_num_tables = src_d_state->m_num_tables;
+    d_state->m_table_to_topic   = src_d_state->m_table_to_topic;
+    d_state->m_word_counts_by_t = src_d_state->m_word_counts_by_t;
+    d_state->m_word_stats_by_t  = src_d_state->m_word_stats_by_t;
+    d_state->m_token_words = src_d_state->m_token_words;
+    d_state->m_token_tables = src_d_state->m_token_tables;
+
+    m_doc_states[d] = d_state;
+    m_private_docs.push_back(d);
+    return d_state;
+}
 
-    m_num_tables_by_z  = state->m_num_tables_by_z;
-    m_word_counts_by_z = state->m_word_counts_by_z;
+/// add an accepted proposal to this state. the proposal only moves tables,
+/// so the documents it copied differ from ours in their table topics alone,
+/// and only the topics of those tables change. proposals on disjoint topics
+/// set up from the same state can be committed one after the other: the
+/// topics a proposal created take the next free ids here.
+void hdp_state::commit_proposal(const sm_move & move)
+{
+    const hdp_state* proposal = move.proposal;
+    int first_new = proposal->m_base_num_topics;
+    int num_topics = m_num_topics + proposal->m_num_topics - first_new;
+    int k, t;
 
-    int size = state->m_word_counts_by_zd.size();
-    m_word_counts_by_zd.resize(size, NULL);
-    m_word_counts_by_zw.resize(size, NULL);
-    for (int k = 0; k < size; k ++)
+    m_word_counts_by_wz.reserve(num_topics + 1);
+    if ((int)m_num_tables_by_z.size() < num_topics + 1)
     {
-        m_word_counts_by_zd[k] = new int [m_num_docs];
-        memcpy(m_word_counts_by_zd[k], state->m_word_counts_by_zd[k], sizeof(int)*m_num_docs);
-        m_word_counts_by_zw[k] = new int [m_size_vocab];
-        memcpy(m_word_counts_by_zw[k], state->m_word_counts_by_zw[k], sizeof(int)*m_size_vocab);
+        m_num_tables_by_z.resize(num_topics + 1, 0);
+        m_word_counts_by_z.resize(num_topics + 1, 0);
     }
 
-    m_doc_states = new doc_state* [m_num_docs];
-    for (int d = 0; d < m_num_docs; d++)
+    /// the ids here of the topics of the proposal
+    int_vec new_k(proposal->m_num_topics);
+    for (k = 0; k < proposal->m_num_topics; k++)
+        new_k[k] = k < first_new ? k : m_num_topics + k - first_new;
+
+    vector <doc_table> moved;
+    int_vec topics; // of the proposal, whose tables changed
+    doc_table table;
+    for (unsigned int j = 0; j < proposal->m_private_docs.size(); j++)
+    {
+        table.d = proposal->m_private_docs[j];
+        doc_state* d_state = m_doc_states[table.d];
+        const doc_state* new_d_state = proposal->m_doc_states[table.d];
+        for (t = 0; t < d_state->m_num_tables; t++)
+        {
+            /// only the tables of the topics of the move; a move of the same
+            /// batch committed before may have moved others of the document
+            k = new_d_state->m_table_to_topic[t];
+            if (k != move.k0 && k != move.k1) continue;
+            int old_k = d_state->m_table_to_topic[t];
+            if (new_k[k] == old_k) continue;
+
+            d_state->m_table_to_topic[t] = new_k[k];
+
+            table.t = t;
+            moved.push_back(table);
+            if (find(topics.begin(), topics.end(), old_k) == topics.end()) topics.push_back(old_k);
+            if (find(topics.begin(), topics.end(), k) == topics.end()) topics.push_back(k);
+        }
+    }
+
+    /// the tables that moved leave the lists of their old topics
+    if ((int)m_tables_by_z.size() < num_topics)
+        m_tables_by_z.resize(num_topics);
+    for (unsigned int j = 0; j < topics.size(); j++)
+    {
+        k = new_k[topics[j]];
+        vector <doc_table> & tables = m_tables_by_z[k];
+        unsigned int n = 0;
+        for (unsigned int m = 0; m < tables.size(); m++)
+            if (m_doc_states[tables[m].d]->m_table_to_topic[tables[m].t] == k)
+                tables[n++] = tables[m];
+        tables.resize(n);
+    }
+    for (unsigned int j = 0; j < moved.size(); j++)
     {
-        doc_state* src_d_state = state->m_doc_states[d];
-        doc_state* d_state = new doc_state();
-        m_doc_states[d] = d_state;
+        table = moved[j];
+        m_tables_by_z[m_doc_states[table.d]->m_table_to_topic[table.t]].push_back(table);
+    }
 
-        /// copy doc state
-        d_state->m_doc_id     = src_d_state->m_doc_id;
-        d_state->m_doc_length = src_d_state->m_doc_length;
-        d_state->m_num_tables = src_d_state->m_num_tables;
+    const int_vec & words = proposal->m_word_counts_by_wz.m_private_words;
+    for (unsigned int j = 0; j < topics.size(); j++)
+    {
+        k = topics[j];
+        sort(m_tables_by_z[new_k[k]].begin(), m_tables_by_z[new_k[k]].end());
+        m_num_tables_by_z[new_k[k]]  = proposal->m_num_tables_by_z[k];
+        m_word_counts_by_z[new_k[k]] = proposal->m_word_counts_by_z[k];
+        for (unsigned int m = 0; m < words.size(); m++)
+            m_word_counts_by_wz(words[m], new_k[k]) = proposal->m_word_counts_by_wz(words[m], k);
+    }
 
-        d_state->m_table_to_topic = src_d_state->m_table_to_topic;
-        d_state->m_word_counts_by_t = src_d_state->m_word_counts_by_t;
+    m_stats.topics_born += num_topics - m_num_topics;
+    m_num_topics = num_topics;
+    m_sparse_dirty = true;
 
-        /// copy table statistics
-        size = src_d_state->m_word_stats_by_t.size();
-        d_state->m_word_stats_by_t.resize(size, word_stats());
+    m_table_terms      += proposal->m_table_terms;
+    m_topic_terms      += proposal->m_topic_terms;
+    m_topic_word_terms += proposal->m_topic_word_terms;
+    m_word_terms       += proposal->m_word_terms;
+    if (proposal->m_likelihood_dirty) m_likelihood_dirty = true;
+}
 
-        for (int t = 0; t < size; t ++)
-            d_state->m_word_stats_by_t[t] = src_d_state->m_word_stats_by_t[t];
+void hdp_state::free_private_docs()
+{
+    for (unsigned int j = 0; j < m_private_docs.size(); j++)
+        delete m_doc_states[m_private_docs[j]];
+    m_private_docs.clear();
+}
 
-        d_state->m_words = new word_info [d_state->m_doc_length];
-        memcpy(d_state->m_words, src_d_state->m_words, sizeof(word_info)*d_state->m_doc_length);
+/// the proposals don't own the documents they share with this state
+void hdp_state::free_proposals()
+{
+    for (unsigned int p = 0; p < m_proposals.size(); p++)
+    {
+        hdp_state* proposal = m_proposals[p];
+        proposal->free_private_docs();
+        delete [] proposal->m_doc_states;
+        proposal->m_doc_states = NULL;
+        delete proposal;
     }
+    m_proposals.clear();
 }
 
 ACTION hdp_state::select_mcmc_move(int& d0, int& d1, int& t0, int& t1)
@@ -1083,8 +2114,8 @@ ACTION hdp_state::select_mcmc_move(int& d0, int& d1, int& t0, int& t1)
         if (d1 == d0) d1 = m_num_docs-1;
         int i0 = runiform_int(m_doc_states[d0]->m_doc_length);
         int i1 = runiform_int(m_doc_states[d1]->m_doc_length);
-        t0 = m_doc_states[d0]->m_words[i0].m_table_assignment;
-        t1 = m_doc_states[d1]->m_words[i1].m_table_assignment;
+        t0 = m_doc_states[d0]->m_token_tables[i0];
+        t1 = m_doc_states[d1]->m_token_tables[i1];
     }
 */
  /*   if (seed_from_same_doc)
@@ -1094,8 +2125,8 @@ ACTION hdp_state::select_mcmc_move(int& d0, int& d1, int& t0, int& t1)
         int i0 = runiform_int(m_doc_states[d0]->m_doc_length);
         int i1 = runiform_int(m_doc_states[d0]->m_doc_length-1);
         if (i1 == i0) i1 = m_doc_states[d0]->m_doc_length-1;
-        t0 = m_doc_states[d0]->m_words[i0].m_table_assignment;
-        t1 = m_doc_states[d1]->m_words[i1].m_table_assignment;
+        t0 = m_doc_states[d0]->m_token_tables[i0];
+        t1 = m_doc_states[d1]->m_token_tables[i1];
     }
 
     else
@@ -1166,6 +2197,38 @@ ACTION hdp_state::select_mcmc_move(int& d0, int& d1, int& t0, int& t1)
         return MERGE;
 }
 
+/// the topics of the seed tables of a move, and whether it splits or merges
+void hdp_state::seed_move(sm_move & move) const
+{
+    move.k0 = m_doc_states[move.d0]->m_table_to_topic[move.t0];
+    move.k1 = m_doc_states[move.d1]->m_table_to_topic[move.t1];
+    move.action = move.k0 == move.k1 ? SPLIT : MERGE;
+    if (move.action == SPLIT) move.k1 = m_num_topics;
+}
+
+/// set up proposals 2p and 2p+1 for a seeded move. evaluate_move() only
+/// writes to them, so moves set up from this state can be evaluated at once.
+void hdp_state::setup_move(sm_move & move, int p)
+{
+    move.proposal = setup_proposal(2 * p);
+    move.intermediate = move.action == MERGE ? setup_proposal(2 * p + 1) : NULL;
+}
+
+void hdp_state::evaluate_move(sm_move & move, int num_scans)
+{
+    if (move.action == SPLIT)
+    {
+        move.scan_prob = move.proposal->split_sampling(num_scans, move.d0, move.d1, move.t0, move.t1);
+        move.likelihood_ratio = compute_split_ratio(move.proposal, this, move.k0, move.k1, move.proposal);
+    }
+    else // action == MERGE
+    {
+        move.scan_prob = move.intermediate->split_sampling(num_scans, move.d0, move.d1, move.t0, move.t1, this);
+        move.proposal->merge_two_topics(move.k0, move.k1);
+        move.likelihood_ratio = -compute_split_ratio(this, move.proposal, move.k0, move.k1, move.proposal);
+    }
+}
+
 void hdp_state::doc_table_state_update(doc_state* d_state, int t, int update, int k)
 {
     if (k < 0)  k = d_state->m_table_to_topic[t];
@@ -1173,21 +2236,27 @@ void hdp_state::doc_table_state_update(doc_state* d_state, int t, int update, in
 
     assert(k >= 0);
 
+    set_lgamma_caches();
+    m_topic_terms += lgamma_change(m_num_tables_by_z[k], update, 0.0);
+    m_topic_word_terms += m_lgamma_v_eta.diff(m_word_counts_by_z[k], update * d_state->m_word_counts_by_t[t]);
     m_num_tables_by_z[k] += update;
     m_word_counts_by_z[k] += update * d_state->m_word_counts_by_t[t];
 
-    int w, c, d = d_state->m_doc_id;
+    int w, c;
 
-    word_stats::iterator iter = d_state->m_word_stats_by_t[t].begin();
-    for (; iter != d_state->m_word_stats_by_t[t].end(); iter ++)
+    const word_stats & stats = d_state->m_word_stats_by_t;
+    const int* words = stats.words(t);
+    const int* counts = stats.counts(t);
+    for (int m = 0; m < stats.size(t); m ++)
     {
-        w = (*iter).first;
-        c = (*iter).second;
-        m_word_counts_by_zw[k][w] += update * c;
-        m_word_counts_by_zd[k][d] += update * c;
+        w = words[m];
+        c = counts[m];
+        if (m_base_state != NULL) touch_word(w);
+        m_word_terms += m_lgamma_eta.diff(m_word_counts_by_wz(w, k), update * c);
+        m_word_counts_by_wz(w, k) += update * c;
     }
-
     if (update == -1) d_state->m_table_to_topic[t] = -1;
+    m_sparse_dirty = true; // split-merge moves don't maintain the sparse caches
 
     if (update == 1 && k == m_num_topics)
     {
@@ -1196,15 +2265,8 @@ void hdp_state::doc_table_state_update(doc_state* d_state, int t, int update, in
         {
             m_num_tables_by_z.push_back(0);
             m_word_counts_by_z.push_back(0);
-
-            int* p = new int [m_num_docs];
-            memset(p, 0, sizeof(int)*m_num_docs);
-            m_word_counts_by_zd.push_back(p);
-
-            p = new int [m_size_vocab];
-            memset(p, 0, sizeof(int)*m_size_vocab);
-            m_word_counts_by_zw.push_back(p);
         }
+        m_word_counts_by_wz.reserve(m_num_topics+1);
     }
 }
 
@@ -1217,23 +2279,23 @@ double hdp_state::sample_table_assignment_sm(doc_state* d_state, int t, bool rem
     double p0 = log(m_num_tables_by_z[k0]);
     double p1 = log(m_num_tables_by_z[k1]);
 
-    double v_eta = m_size_vocab * m_eta;
+    set_lgamma_caches();
     int    count = d_state->m_word_counts_by_t[t];
 
-    p0 += lgamma(v_eta + m_word_counts_by_z[k0]) - lgamma(v_eta + m_word_counts_by_z[k0] + count);
-    p1 += lgamma(v_eta + m_word_counts_by_z[k1]) - lgamma(v_eta + m_word_counts_by_z[k1] + count);
+    p0 -= m_lgamma_v_eta.diff(m_word_counts_by_z[k0], count);
+    p1 -= m_lgamma_v_eta.diff(m_word_counts_by_z[k1], count);
 
     int w, c;
-    word_stats::iterator iter = d_state->m_word_stats_by_t[t].begin();
-    for (; iter != d_state->m_word_stats_by_t[t].end(); iter ++)
+    const word_stats & stats = d_state->m_word_stats_by_t;
+    const int* words = stats.words(t);
+    const int* counts = stats.counts(t);
+    for (int m = 0; m < stats.size(t); m ++)
     {
-        w = (*iter).first; c = (*iter).second;
+        w = words[m]; c = counts[m];
         //assert(c > 0);
-        p0 += lgamma(m_eta + m_word_counts_by_zw[k0][w] + c)
-            - lgamma(m_eta + m_word_counts_by_zw[k0][w]);
-
-        p1 += lgamma(m_eta + m_word_counts_by_zw[k1][w] + c)
-            - lgamma(m_eta + m_word_counts_by_zw[k1][w]);
+        const int* counts_w = m_word_counts_by_wz.row(w);
+        p0 += m_lgamma_eta.diff(counts_w[k0], c);
+        p1 += m_lgamma_eta.diff(counts_w[k1], c);
     }
 
     double p = log_sum(p0, p1);
@@ -1274,6 +2336,8 @@ void hdp_state::merge_two_topics(int k0, int k1)
 {
     /// merge two topics into one, k0, k1 --> k0
     assert(k0 != k1); // make sure they are not the same topic
+    m_sparse_dirty = true;
+    m_likelihood_dirty = true;
 
     m_num_tables_by_z[k0] += m_num_tables_by_z[k1];
     m_num_tables_by_z[k1] = 0;
@@ -1282,21 +2346,24 @@ void hdp_state::merge_two_topics(int k0, int k1)
 
     for (int w = 0; w < m_size_vocab; w ++)
     {
-        m_word_counts_by_zw[k0][w] += m_word_counts_by_zw[k1][w];
-        m_word_counts_by_zw[k1][w] = 0;
+        if (m_word_counts_by_wz(w, k1) == 0) continue;
+        if (m_base_state != NULL) touch_word(w);
+        int* counts_w = m_word_counts_by_wz.row(w);
+        counts_w[k0] += counts_w[k1];
+        counts_w[k1] = 0;
     }
 
-    for (int d = 0; d < m_num_docs; d ++)
-    {
-        m_word_counts_by_zd[k0][d] += m_word_counts_by_zd[k1][d];
-        m_word_counts_by_zd[k1][d] = 0;
+    /// a proposal leaves the index to commit_proposal()
+    const hdp_state* index = m_base_state != NULL ? m_base_state : this;
+    const vector <doc_table> & tables = index->m_tables_by_z[k1];
+    for (unsigned int j = 0; j < tables.size(); j ++)
+        touch_doc(tables[j].d)->m_table_to_topic[tables[j].t] = k0;
 
-        doc_state* d_state = m_doc_states[d];
-        for (int t = 0; t < d_state->m_num_tables; t ++)
-        {
-            if (d_state->m_table_to_topic[t] == k1)
-                d_state->m_table_to_topic[t] = k0;
-        }
+    if (m_base_state == NULL)
+    {
+        m_tables_by_z[k0].insert(m_tables_by_z[k0].end(), tables.begin(), tables.end());
+        sort(m_tables_by_z[k0].begin(), m_tables_by_z[k0].end());
+        m_tables_by_z[k1].clear();
     }
 }
 
@@ -1306,55 +2373,49 @@ double hdp_state::split_sampling(int num_scans, int d0, int d1, int t0, int t1,
     int k0 = m_doc_states[d0]->m_table_to_topic[t0];
     int k1 = m_doc_states[d1]->m_table_to_topic[t1];
 
-    int_vec vec_docs, vec_tables;
-    vec_docs.reserve(2 * m_num_docs);
-    vec_tables.reserve(2 * m_num_docs);
+    /// the tables of k0 and k1 in document order, as the state the proposal
+    /// reads has them
+    const hdp_state* index = m_base_state != NULL ? m_base_state : this;
+    vector <doc_table> tables;
 
     int d, t, i, j, target_k;
     if (target_state == NULL) // split to some state
     {
         assert(k0 == k1);
         k1 = m_num_topics;
-        doc_table_state_update(m_doc_states[d1], t1, -1);     // detach table
-        doc_table_state_update(m_doc_states[d1], t1, +1, k1); // attach table
-
-        for (d = 0; d < m_num_docs; d ++)
-        {
-            doc_state* d_state = m_doc_states[d];
-            for (t = 0; t < d_state->m_num_tables; t ++)
-            {
-                if (d_state->m_table_to_topic[t] == k0)
-                {
-                    if (d == d0 && t == t0) continue;
-                    vec_docs.push_back(d);
-                    vec_tables.push_back(t);
-                    doc_table_state_update(d_state, t, -1);
-                }
-            }
-        }
+        doc_table_state_update(touch_doc(d1), t1, -1);     // detach table
+        doc_table_state_update(touch_doc(d1), t1, +1, k1); // attach table
+        tables = index->m_tables_by_z[k0];
     }
     else   // split to target state
     {
         assert(k0 != k1);
-        for (d = 0; d < m_num_docs; d ++)
-        {
-            doc_state* d_state = m_doc_states[d];
-            for (t = 0; t < d_state->m_num_tables; t ++)
-            {
-                if (d_state->m_table_to_topic[t] == k0 || d_state->m_table_to_topic[t] == k1)
-                {
-                    if ((d == d0 && t == t0) || (d == d1 && t == t1)) continue;
-                    vec_docs.push_back(d);
-                    vec_tables.push_back(t);
-                    doc_table_state_update(d_state, t, -1);
-                }
-            }
-        }
+        const vector <doc_table> & tables0 = index->m_tables_by_z[k0];
+        const vector <doc_table> & tables1 = index->m_tables_by_z[k1];
+        tables.resize(tables0.size() + tables1.size());
+        merge(tables0.begin(), tables0.end(), tables1.begin(), tables1.end(), tables.begin());
+    }
+
+    int_vec vec_docs, vec_tables;
+    vec_docs.reserve(tables.size());
+    vec_tables.reserve(tables.size());
+    for (j = 0; j < (int)tables.size(); j ++)
+    {
+        d = tables[j].d;
+        t = tables[j].t;
+        if ((d == d0 && t == t0) || (d == d1 && t == t1)) continue;
+        vec_docs.push_back(d);
+        vec_tables.push_back(t);
+        doc_table_state_update(touch_doc(d), t, -1);
     }
 
     size_t size = vec_docs.size();
-    gsl_permutation* p = gsl_permutation_calloc(size);
-    rshuffle(p->data, size, sizeof(size_t)); // shuffle the sequence
+    gsl_permutation* p = NULL; // no tables besides the two seeds
+    if (size > 0)
+    {
+        p = gsl_permutation_calloc(size);
+        rshuffle(p->data, size, sizeof(size_t)); // shuffle the sequence
+    }
 
     double prob = 0.0;
     for (i = 0; i < (int)size; i ++)
@@ -1408,30 +2469,34 @@ double hdp_state::split_sampling(int num_scans, int d0, int d1, int t0, int t1,
     return prob;
 }
 
-double compute_split_ratio(const hdp_state* split_state, const hdp_state* merge_state, int k0, int k1)
+/// the lgamma caches of scratch_state are used, so that moves evaluated at
+/// once don't share them
+double compute_split_ratio(const hdp_state* split_state, const hdp_state* merge_state,
+                           int k0, int k1, const hdp_state* scratch_state)
 {
     double ratio = 0.0;
-    double eta = split_state->m_eta;
     int size_vocab = split_state->m_size_vocab;
 
-    double lgamma_eta = lgamma(eta);
-    double v_eta = size_vocab * eta;
-    double lgamma_v_eta = lgamma(v_eta);
+    scratch_state->set_lgamma_caches();
+    lgamma_cache & lgamma_eta = scratch_state->m_lgamma_eta;
+    lgamma_cache & lgamma_v_eta = scratch_state->m_lgamma_v_eta;
 
-    ratio += lgamma_v_eta - lgamma(v_eta + split_state->m_word_counts_by_z[k0]);
-    ratio += lgamma_v_eta - lgamma(v_eta + split_state->m_word_counts_by_z[k1]);
-    ratio -= lgamma_v_eta - lgamma(v_eta + merge_state->m_word_counts_by_z[k0]);
+    ratio -= lgamma_v_eta.diff(0, split_state->m_word_counts_by_z[k0]);
+    ratio -= lgamma_v_eta.diff(0, split_state->m_word_counts_by_z[k1]);
+    ratio += lgamma_v_eta.diff(0, merge_state->m_word_counts_by_z[k0]);
 
     for (int w = 0; w < size_vocab; w++)
     {
-        if (split_state->m_word_counts_by_zw[k0][w] > 0)
-            ratio += lgamma(split_state->m_word_counts_by_zw[k0][w] + eta) - lgamma_eta;
+        const int* split_w = split_state->m_word_counts_by_wz.row(w);
+        const int* merge_w = merge_state->m_word_counts_by_wz.row(w);
+        if (split_w[k0] > 0)
+            ratio += lgamma_eta.diff(0, split_w[k0]);
 
-        if (split_state->m_word_counts_by_zw[k1][w] > 0)
-            ratio += lgamma(split_state->m_word_counts_by_zw[k1][w] + eta) - lgamma_eta;
+        if (split_w[k1] > 0)
+            ratio += lgamma_eta.diff(0, split_w[k1]);
 
-        if (merge_state->m_word_counts_by_zw[k0][w] > 0)
-            ratio -= lgamma(merge_state->m_word_counts_by_zw[k0][w] + eta) - lgamma_eta;
+        if (merge_w[k0] > 0)
+            ratio -= lgamma_eta.diff(0, merge_w[k0]);
     }
 
     ratio += log(split_state->m_gamma)
@@ -2,7 +2,15 @@
 #define STATE_H
 
 #include "corpus.h"
+#include "counts.h"
+#include "lgamma_cache.h"
+#include "alias.h"
+#include "output.h"
+#include "model.h"
 #include <map>
+#include <stdio.h>
+
+enum STOP_RULE {STOP_NONE, STOP_LIKELIHOOD, STOP_TOPICS};
 
 class hdp_hyperparameter
 {
@@ -18,14 +26,39 @@ public:
 
     bool m_sample_hyperparameter;
     bool m_split_merge_sampler;
+    int  m_sampler;
+    int  m_num_threads;
+    int  m_output_format;
+
+    /// stopping rule, see hdp::converged(): a run stops after m_min_iter
+    /// iterations at the earliest, and after m_max_iter at the latest
+    int    m_stop_rule;
+    int    m_min_iter;
+    int    m_stop_window;
+    double m_stop_tol;
+
+    /// iterations before the posterior averages, -1 for none
+    int    m_burn_in;
 
 public:
+    hdp_hyperparameter()
+    {
+        m_stop_rule = STOP_NONE;
+        m_min_iter = 0;
+        m_stop_window = 20;
+        m_stop_tol = 0.0;
+        m_burn_in = -1;
+    }
+
     void setup_parameters(double _gamma_a, double _gamma_b,
                         double _alpha_a, double _alpha_b,
                         int _max_iter, int _save_lag,
                         int _num_restricted_scans,
                         bool _sample_hyperparameter,
-                        bool _split_merge_sampler)
+                        bool _split_merge_sampler,
+                        int _sampler,
+                        int _num_threads,
+                        int _output_format)
     {
         m_gamma_a   = _gamma_a;
         m_gamma_b   = _gamma_b;
@@ -36,21 +69,123 @@ public:
         m_num_restricted_scans = _num_restricted_scans;
         m_sample_hyperparameter = _sample_hyperparameter;
         m_split_merge_sampler = _split_merge_sampler;
+        m_sampler = _sampler;
+        m_num_threads = _num_threads;
+        m_output_format = _output_format;
+    }
+
+    void setup_stopping_rule(int _stop_rule, int _min_iter,
+                             int _stop_window, double _stop_tol)
+    {
+        m_stop_rule = _stop_rule;
+        m_min_iter = _min_iter;
+        m_stop_window = _stop_window;
+        m_stop_tol = _stop_tol;
+    }
+
+    void setup_average(int _burn_in)
+    {
+        m_burn_in = _burn_in;
     }
 };
 
 typedef vector<int> int_vec; // define the vector of int
 typedef vector<double> double_vec; // define the vector of double
-typedef map<int, int> word_stats;
 enum ACTION {SPLIT, MERGE};
+enum SAMPLER {DENSE_SAMPLER, SPARSE_SAMPLER, ALIAS_SAMPLER};
 
-/// word info structure used in the main class
-struct word_info
+/// the table of a token in its document. a document can't have more than
+/// MAX_TABLES_PER_DOC tables, a longer one stops opening new tables there.
+typedef uint16_t table_id;
+#define NO_TABLE 0xffff
+#define MAX_TABLES_PER_DOC 0xffff
+
+class hdp_state;
+
+/// a split-merge move: the two seed tables, and the proposals that score it,
+/// see hdp_state::setup_move()
+struct sm_move
 {
 public:
-    int m_word_index;
-    int m_table_assignment;
-    //int m_topic_assignment; // this is extra information
+    ACTION action;
+    int d0, t0, d1, t1;
+    int k0, k1;
+    hdp_state* proposal;     // the split state, or the merged state
+    hdp_state* intermediate; // a merge: the split state it is scored against
+    double likelihood_ratio; // log, the proposal against the current state
+    double scan_prob;        // log, of the restricted scans
+};
+
+/// table t of the document at m_doc_states[d]
+struct doc_table
+{
+public:
+    int d;
+    int t;
+    bool operator<(const doc_table & other) const
+    {
+        return d < other.d || (d == other.d && t < other.t);
+    }
+};
+
+/// word histograms of all the tables in a document, stored flat: table t
+/// owns entries [m_offsets[t], m_offsets[t+1]) of m_words and m_counts.
+/// the vectors keep their capacity, so rebuilding the histograms every
+/// iteration doesn't allocate once they have grown to the document length.
+class word_stats
+{
+public:
+    int_vec m_offsets;
+    int_vec m_words;   // distinct words of each table
+    int_vec m_counts;  // and their counts
+public:
+    int size(int t) const
+    {
+        return m_offsets[t+1] - m_offsets[t];
+    }
+    const int* words(int t) const
+    {
+        return m_words.empty() ? NULL : &m_words[0] + m_offsets[t];
+    }
+    const int* counts(int t) const
+    {
+        return m_counts.empty() ? NULL : &m_counts[0] + m_offsets[t];
+    }
+    void clear()
+    {
+        m_offsets.clear();
+        m_words.clear();
+        m_counts.clear();
+    }
+};
+
+/// what an iteration spent its time on, in seconds, and what it changed.
+/// hdp::run() resets it each iteration and writes it to phases.log
+struct phase_stats
+{
+public:
+    double word_time;
+    double table_time;
+    double compact_time;
+    double hyper_time;
+    double likelihood_time;
+    double save_time;
+    double split_merge_time;
+    long   tables_created;
+    long   tables_destroyed;
+    long   topics_born;
+    long   bytes_written;
+public:
+    phase_stats()
+    {
+        reset();
+    }
+    void reset()
+    {
+        word_time = table_time = compact_time = hyper_time = 0.0;
+        likelihood_time = save_time = split_merge_time = 0.0;
+        tables_created = tables_destroyed = topics_born = bytes_written = 0;
+    }
 };
 
 class doc_state
@@ -59,19 +194,21 @@ public:
     int m_doc_id; // document id
     int m_doc_length;  // document length
     int m_num_tables;  // number of tables in this document
-    word_info * m_words;
+    uint32_t * m_token_words;  // word of each token, in the arrays of the hdp_state
+    table_id * m_token_tables; // table of each token, likewise
 
     int_vec m_table_to_topic; // for a doc, translate its table index to topic index
     int_vec m_word_counts_by_t; // word counts for each table
-    vector< word_stats > m_word_stats_by_t;
+    word_stats m_word_stats_by_t; // word histogram for each table
 
     //vector < vector<int> > m_words_by_zi; // stores the word idx indexed by z then i
 public:
     doc_state();
     virtual ~doc_state();
 public:
-    void setup_state_from_doc(const document * doc);
+    void setup_state_from_doc(const document * doc, uint32_t * words, table_id * tables);
     void free_doc_state();
+    void topic_counts(int_vec & topics, int_vec & counts) const;
 };
 
 class hdp_state
@@ -83,8 +220,11 @@ public:
     int m_total_words;
     int m_num_docs;
 
-/// document states
+/// document states, and the tokens of all of them as two arrays: the words,
+/// which only the permutation reorders, and the tables the samplers assign
     doc_state** m_doc_states;
+    uint32_t * m_token_words;
+    table_id * m_token_tables;
 
 /// number of topics
     int m_num_topics;
@@ -92,13 +232,17 @@ public:
     int m_total_num_tables;
 
 /// by_z, by topic
-/// by_d, by document, for each topic
 /// by_w, by word, for each topic
+/// by_wz, by topic, for each word
 /// by_t, by table for each document
     int_vec   m_num_tables_by_z; // how many tables each topic has
     int_vec   m_word_counts_by_z;   // word counts for each topic
-    vector <int*> m_word_counts_by_zd; // word counts for [each topic, each doc]
-    vector <int*> m_word_counts_by_zw; // word counts for [each topic, each word]
+    word_topic_counts m_word_counts_by_wz; // word counts for [each word, each topic]
+
+/// the tables of each topic in document order, rebuilt by compact_hdp_state()
+/// and kept by commit_proposal(), for the split-merge moves. the sweeps
+/// don't keep it, it is stale until the next compaction.
+    vector <vector<doc_table> > m_tables_by_z;
 
 /// topic Dirichlet parameter
     double m_eta;
@@ -106,6 +250,67 @@ public:
 /// including concentration parameters
     double m_gamma;
     double m_alpha;
+
+/// word sampler, DENSE_SAMPLER, SPARSE_SAMPLER or ALIAS_SAMPLER, and the
+/// caches for the smoothing and word-topic buckets of the sparse ones
+    int  m_sampler;
+    bool m_sparse_dirty;  // caches need to be rebuilt from the counts
+    vector <int_vec> m_topics_by_w; // topics with non-zero counts for each word
+    double_vec m_smoothing_by_z;    // m_num_tables_by_z[k] * eta / (n_k + V*eta)
+    double_vec m_inv_denom_by_z;    // 1 / (n_k + V*eta), also kept by the dense sampler
+    double m_smoothing_sum;         // sum of m_smoothing_by_z
+/// ALIAS_SAMPLER: a stale copy of the smoothing bucket, with the new topic
+/// last, the topics of new tables are proposed from, see draw_smoothing_topic()
+    alias_table m_smoothing_alias;
+    double m_smoothing_bound; // at least m_smoothing_by_z[k] over its weight in the table, for any k
+
+/// scratch buffers for building the table histograms, never copied
+    int_vec m_word_scratch;   // one entry per word, all zero between uses
+    int_vec m_table_tokens;   // words of a document, grouped by table
+    int_vec m_table_scratch;  // one entry per table of a document
+    int_vec m_token_order;    // a permutation of the tokens of a document
+    int_vec m_token_scratch;  // one entry per token of a document
+/// the sums of the dense word sampler over blocks of topics, see topic_weights()
+    double_vec m_topic_sums;
+
+/// lgamma(eta + n) and lgamma(V*eta + n), see set_lgamma_caches()
+    mutable lgamma_cache m_lgamma_eta;
+    mutable lgamma_cache m_lgamma_v_eta;
+
+/// the terms of the joint likelihood that depend on the counts, kept up to
+/// date by the count updates, see joint_likelihood()
+    double m_table_terms;       // sum over tables of lgamma(n_dt)
+    double m_topic_terms;       // sum over topics of lgamma(m_k)
+    double m_topic_word_terms;  // sum over topics of lgamma(n_k + V*eta) - lgamma(V*eta)
+    double m_word_terms;        // sum over words and topics of lgamma(n_wk + eta) - lgamma(eta)
+    bool   m_likelihood_dirty;  // the terms need to be recomputed
+    int    m_num_likelihoods;   // likelihoods since they were last recomputed
+
+/// parallel sweeps: the threads and their workers. a worker samples a slice
+/// of the documents against m_base_state, with its own topic counts and
+/// the changes to the word counts, and can't create more than
+/// m_max_num_topics topics
+    int m_num_threads;
+    vector <hdp_state*> m_workers;
+    const hdp_state* m_base_state;
+    int m_max_num_topics;
+
+/// split-merge proposals, see setup_proposal(). a proposal reads the counts
+/// and the documents of m_base_state, and copies the rows and the documents
+/// it changes; m_private_docs are the documents it copied
+    vector <hdp_state*> m_proposals;
+    int_vec m_private_docs;
+    int m_base_num_topics; // topics of the base when the proposal was set up
+
+/// TEXT_OUTPUT or BINARY_OUTPUT, how save_state() writes the counts
+    int m_output_format;
+/// where the progress of the sampler is printed, stdout unless set
+    FILE* m_log;
+/// timings and counts of the current iteration
+    phase_stats m_stats;
+/// sums of the posterior averages after the burn-in, NULL without, see
+/// average.cpp
+    posterior_average* m_average;
 public:
     hdp_state();
     virtual ~hdp_state();
@@ -118,25 +323,94 @@ public:
     void   iterate_gibbs_state(bool remove, bool permute,
                                hdp_hyperparameter* hdp_hyperparam,
                                bool table_sampling=false);
+    void   sweep_docs(bool remove, bool table_sampling);
 
     void   sample_first_level_concentration(hdp_hyperparameter* hdp_hyperparam);
     void   sample_second_level_concentration(hdp_hyperparameter* hdp_hyperparam);
     void   sample_tables(doc_state* d_state, double_vec & q, double_vec & f);
-    void   sample_table_assignment(doc_state* d_state, int t, int* words, double_vec & q, double_vec & f);
+    void   sample_table_assignment(doc_state* d_state, int t,
+                                   const int* words, const int* counts, int num_words,
+                                   double_vec & q, double_vec & f);
     void   sample_word_assignment(doc_state* d_state, int i, bool remove, double_vec & q, double_vec & f);
+    void   sample_word_assignment_sparse(doc_state* d_state, int i, bool remove, double_vec & q, double_vec & f);
+    int    draw_smoothing_topic();
+    void   update_smoothing_alias();
+    int    draw_table_topic(doc_state* d_state, int t,
+                            const int* words, const int* counts, int num_words,
+                            double f_new, double_vec & f);
     void   doc_state_update(doc_state* d_state, int i, int update, int k=-1);
     void   compact_doc_state(doc_state* d_state, int* k_to_new_k);
+    void   permute_tokens(doc_state* d_state);
+    void   build_word_stats(doc_state* d_state);
     void   compact_hdp_state();
     double doc_partition_likelihood(doc_state* d_state);
     double table_partition_likelihood();
     double data_likelihood();
     double joint_likelihood(hdp_hyperparameter * hdp_hyperparam);
+    void   compute_likelihood_terms();
+    void   compute_topic_terms();
+    double word_terms(int w) const;
+    void   set_lgamma_caches() const
+    {
+        m_lgamma_eta.set(m_eta);
+        m_lgamma_v_eta.set(m_size_vocab * m_eta);
+    }
+
+    /// book keepings for the sparse samplers
+    bool   sparse_sampler() const
+    {
+        return m_sampler != DENSE_SAMPLER;
+    }
+    void   rebuild_sparse_state();
+    void   update_sparse_topic(int k);
+    void   rebuild_topic_denoms();
+    void   update_topic_denom(int k);
+    void   update_sparse_word(int k, int w, int update);
+    const int_vec & word_topics(int w) const
+    {
+        if (m_base_state != NULL && !m_word_counts_by_wz.is_private(w))
+            return m_base_state->m_topics_by_w[w];
+        return m_topics_by_w[w];
+    }
+
+    /// the parallel sweep, in parallel.cpp
+    void   iterate_gibbs_state_parallel(bool table_sampling);
+    void   setup_worker(hdp_state* worker, int first_doc, int num_docs);
+    void   finish_worker();
+    void   merge_worker(const hdp_state* worker, int num_topics);
+    void   merge_worker_stats(double seconds);
+    void   free_workers();
+    void   touch_word(int w);
+    bool   can_add_topic() const
+    {
+        return m_num_topics < m_max_num_topics;
+    }
     void   save_state(char * name);
+    void   save_state_bin(char * name);
     void   save_state_ex(char * name);
     void   load_state_ex(char * name);
+    void   save_checkpoint(char * name, const hdp_hyperparameter * hdp_param,
+                           const run_state * run);
+    void   load_checkpoint(char * name, hdp_hyperparameter * hdp_param,
+                           run_state * run);
+    void   write_model(const char * name, const hdp_hyperparameter * hdp_param,
+                       const run_state * run);
+
+    /// the posterior averages, in average.cpp
+    void   setup_average(int burn_in);
+    void   accumulate_average();
+    void   save_average(const char * name, int iteration);
 
     /// the followings are the functions used in the split-merge algorithm
-    void   copy_state(const hdp_state* state);
+    hdp_state* setup_proposal(int p);
+    void   seed_move(sm_move & move) const;
+    void   setup_move(sm_move & move, int p);
+    void   evaluate_move(sm_move & move, int num_scans);
+    void   evaluate_moves(vector <sm_move> & moves, int num_scans);
+    void   commit_proposal(const sm_move & move);
+    void   free_proposals();
+    void   free_private_docs();
+    doc_state* touch_doc(int d);
     ACTION select_mcmc_move(int& d0, int& d1, int& t0, int& t1);
     void   doc_table_state_update(doc_state* d_state, int t, int update, int k=-1);
     double sample_table_assignment_sm(doc_state* d_state, int t, bool remove,
@@ -144,7 +418,8 @@ public:
     void   merge_two_topics(int k0, int k1);
     double split_sampling(int num_scans, int d0, int d1, int t0, int t1,
                                      hdp_state * target_state=NULL);
-    friend double compute_split_ratio(const hdp_state* split_state, const hdp_state* merge_state, int k0, int k1);
+    friend double compute_split_ratio(const hdp_state* split_state, const hdp_state* merge_state,
+                                      int k0, int k1, const hdp_state* scratch_state);
 
     /// functions that should not be used when running the experiments
     bool   state_check_sum();
@@ -0,0 +1,140 @@
+#include "topic_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOPIC_KERNEL_X86
+#endif
+
+/// a block of four topics from b on, the ones past n count as zero. the sum
+/// of the block is (w0 + w1) + (w2 + w3) in every kernel; the kernels don't
+/// use fused multiply-adds, which would round differently
+static inline double block_weights(const int* counts_w, const int* num_tables, const double* inv_denom,
+                                   double eta, int b, int n, double* f)
+{
+    double w[4] = {0.0, 0.0, 0.0, 0.0};
+    for (int j = 0; j < 4 && b + j < n; j++)
+    {
+        f[b+j] = (counts_w[b+j] + eta) * inv_denom[b+j];
+        w[j] = num_tables[b+j] * f[b+j];
+    }
+    return (w[0] + w[1]) + (w[2] + w[3]);
+}
+
+static double topic_weights_scalar(const int* counts_w, const int* num_tables, const double* inv_denom,
+                                   double eta, int n, double* f, double* sums)
+{
+    double total = 0.0;
+    for (int b = 0; b < n; b += 4)
+    {
+        total += block_weights(counts_w, num_tables, inv_denom, eta, b, n, f);
+        sums[b/4] = total;
+    }
+    return total;
+}
+
+#ifdef TOPIC_KERNEL_X86
+
+__attribute__((target("sse2")))
+static double topic_weights_sse2(const int* counts_w, const int* num_tables, const double* inv_denom,
+                                 double eta, int n, double* f, double* sums)
+{
+    const __m128d eta_2 = _mm_set1_pd(eta);
+    double total = 0.0;
+    int b;
+    for (b = 0; b + 4 <= n; b += 4)
+    {
+        __m128d c_lo = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(counts_w + b)));
+        __m128d c_hi = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(counts_w + b + 2)));
+        __m128d m_lo = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(num_tables + b)));
+        __m128d m_hi = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(num_tables + b + 2)));
+        __m128d f_lo = _mm_mul_pd(_mm_add_pd(c_lo, eta_2), _mm_loadu_pd(inv_denom + b));
+        __m128d f_hi = _mm_mul_pd(_mm_add_pd(c_hi, eta_2), _mm_loadu_pd(inv_denom + b + 2));
+        _mm_storeu_pd(f + b, f_lo);
+        _mm_storeu_pd(f + b + 2, f_hi);
+        __m128d w_lo = _mm_mul_pd(m_lo, f_lo);
+        __m128d w_hi = _mm_mul_pd(m_hi, f_hi);
+        /// (w0 + w1, w2 + w3)
+        __m128d pairs = _mm_add_pd(_mm_unpacklo_pd(w_lo, w_hi), _mm_unpackhi_pd(w_lo, w_hi));
+        total += _mm_cvtsd_f64(pairs) + _mm_cvtsd_f64(_mm_unpackhi_pd(pairs, pairs));
+        sums[b/4] = total;
+    }
+    if (b < n)
+    {
+        total += block_weights(counts_w, num_tables, inv_denom, eta, b, n, f);
+        sums[b/4] = total;
+    }
+    return total;
+}
+
+__attribute__((target("avx2")))
+static double topic_weights_avx2(const int* counts_w, const int* num_tables, const double* inv_denom,
+                                 double eta, int n, double* f, double* sums)
+{
+    const __m256d eta_4 = _mm256_set1_pd(eta);
+    double total = 0.0;
+    int b;
+    for (b = 0; b + 4 <= n; b += 4)
+    {
+        __m256d c = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(counts_w + b)));
+        __m256d m = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(num_tables + b)));
+        __m256d f_4 = _mm256_mul_pd(_mm256_add_pd(c, eta_4), _mm256_loadu_pd(inv_denom + b));
+        _mm256_storeu_pd(f + b, f_4);
+        __m256d w = _mm256_mul_pd(m, f_4);
+        /// (w0 + w1, w2 + w3)
+        __m128d pairs = _mm_hadd_pd(_mm256_castpd256_pd128(w), _mm256_extractf128_pd(w, 1));
+        total += _mm_cvtsd_f64(pairs) + _mm_cvtsd_f64(_mm_unpackhi_pd(pairs, pairs));
+        sums[b/4] = total;
+    }
+    if (b < n)
+    {
+        total += block_weights(counts_w, num_tables, inv_denom, eta, b, n, f);
+        sums[b/4] = total;
+    }
+    return total;
+}
+
+#endif // TOPIC_KERNEL_X86
+
+typedef double (*topic_weights_kernel)(const int*, const int*, const double*, double, int, double*, double*);
+
+struct topic_kernel
+{
+    topic_weights_kernel weights;
+    const char* name;
+};
+
+static topic_kernel pick_kernel()
+{
+    topic_kernel kernel = {topic_weights_scalar, "scalar"};
+#ifdef TOPIC_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel.weights = topic_weights_avx2;
+        kernel.name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        kernel.weights = topic_weights_sse2;
+        kernel.name = "sse2";
+    }
+#endif
+    return kernel;
+}
+
+static const topic_kernel & the_kernel()
+{
+    static const topic_kernel kernel = pick_kernel();
+    return kernel;
+}
+
+double topic_weights(const int* counts_w, const int* num_tables, const double* inv_denom,
+                     double eta, int n, double* f, double* sums)
+{
+    return the_kernel().weights(counts_w, num_tables, inv_denom, eta, n, f, sums);
+}
+
+const char* topic_kernel_name()
+{
+    return the_kernel().name;
+}
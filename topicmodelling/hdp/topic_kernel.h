@@ -0,0 +1,31 @@
+#ifndef TOPIC_KERNEL_H
+#define TOPIC_KERNEL_H
+
+/// the topic weights of a word for the dense word sampler, over the first n
+/// topics: f[k] = (n_wk + eta) / (n_k + V*eta) from the counts of the word
+/// and 1 / (n_k + V*eta), and sums[b] the sum of m_k * f[k] over the topics
+/// of the blocks 0..b of four topics. returns the sum over all n topics.
+///
+/// the kernel is picked for the cpu when first called, AVX2, SSE2 or plain
+/// code; they all round alike, so a run samples the same on any machine.
+double topic_weights(const int* counts_w, const int* num_tables, const double* inv_denom,
+                     double eta, int n, double* f, double* sums);
+
+/// the kernel topic_weights() uses: "avx2", "sse2" or "scalar"
+const char* topic_kernel_name();
+
+/// the first i with u < q[i] of the n non-decreasing sums q, or n-1 if u is
+/// past them all, by a binary search without branches
+inline int search_sums(const double* q, int n, double u)
+{
+    const double* base = q;
+    while (n > 1)
+    {
+        int half = n / 2;
+        base = (base[half - 1] <= u) ? base + half : base;
+        n -= half;
+    }
+    return base - q;
+}
+
+#endif // TOPIC_KERNEL_H
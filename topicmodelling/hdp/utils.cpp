@@ -1,6 +1,6 @@
 #include "utils.h"
 
-extern gsl_rng * RANDOM_NUMBER;
+extern __thread gsl_rng * RANDOM_NUMBER;
 
 const double half_ln_2pi = 0.91893853320467267;
 
@@ -96,32 +96,37 @@ bool dir_exists(const char * directory)
 }
 
 /**
- * return factorial log((n-1+a)...(a))
- *
- **/
+*
+* size of a file in bytes, 0 if it doesn't exist
+*/
+long file_size(const char * filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    return st.st_size;
+}
 
-double log_factorial(int n, double a)
+/**
+*
+* seconds on a monotonic clock, for timing
+*/
+double wall_time()
 {
-    if (n == 0) return 0.0;
-    double v = lgamma(n+a) - lgamma(a);
-    return v;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
 }
 
 /**
- * return the cosine similarity
+ * return factorial log((n-1+a)...(a))
  *
  **/
 
-double similarity(const int* v1, const int* v2, int n)
+double log_factorial(int n, double a)
 {
-    double sim = 0.0, norm1 = 0.0, norm2 = 0.0;
-    for (int i = 0; i < n; i ++)
-    {
-        sim += v1[i] * v2[i];
-        norm1 += v1[i] * v1[i];
-        norm2 += v2[i] * v2[i];
-    }
-    return sim/sqrt(norm1*norm2);
+    if (n == 0) return 0.0;
+    double v = lgamma(n+a) - lgamma(a);
+    return v;
 }
 
 /// gsl_wrappers
@@ -179,4 +184,11 @@ unsigned long int runiform_int(unsigned long int n)
     return gsl_rng_uniform_int(RANDOM_NUMBER, n);
 }
 
+/// move the calling thread to the stream of an iteration, so what is drawn
+/// in it doesn't depend on what was drawn before
+void rstream(unsigned int iteration)
+{
+    rng_set_stream(RANDOM_NUMBER, iteration, 0);
+}
+
 // end of the file
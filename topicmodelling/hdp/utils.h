@@ -16,6 +16,7 @@
 #include <gsl/gsl_permutation.h>
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
+#include "rng.h"
 
 #include <vector>
 using namespace std;
@@ -25,10 +26,11 @@ double log_normalize(double * array, int nlen);
 double log_normalize(vector<double> & vec, int nlen);
 double log_subtract(double log_a, double log_b);
 double log_factorial(int n, double a);
-double similarity(const int* v1, const int* v2, int n);
 
 bool   file_exists(const char * filename);
 bool   dir_exists(const char * directory);
+long   file_size(const char * filename);
+double wall_time();
 
 template <typename T> void free_vec_ptr(vector <T* > & v)
 {
@@ -111,6 +113,7 @@ unsigned int rbernoulli(double p);
 double runiform();
 void rshuffle (void* base, size_t n, size_t size);
 unsigned long int runiform_int(unsigned long int n);
+void rstream(unsigned int iteration);
 
 
 #endif